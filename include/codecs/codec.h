@@ -3,10 +3,17 @@
 #include <opencv2/opencv.hpp>
 #include <functional>
 #include <cmath>
+#include <span>
+#include <typeinfo>
+#include <type_traits>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
 
 #include "huffman.h"
 #include "bitstream.h"
 #include "multicut.h"
+#include "edge_map.h"
 
 struct EncodingResult {
     int bits_used; // how many bits the encoding consumed. can be negative because this struct allows 
@@ -46,26 +53,150 @@ struct EncodingResult {
 };
 
 struct PartitionCodecBase {
-    virtual void initialize(const std::vector<PartitionData>* partitions, const cv::Mat* img) = 0;
+    virtual void initialize(const Multicut* multicut, const cv::Mat* img) = 0;
 
     virtual void write_encoding(BitStream& bs) = 0;
 
     virtual EncodingResult test_encoding(partition_key pk) = 0;
     virtual EncodingResult test_join_encoding(partition_key pk1, partition_key pk2) = 0;
+
+    // evaluates test_join_encoding(pk, nbs[i]) for every i and stores the results in out (which has the size of nbs).
+    // codecs can override this to evaluate all neighbours of a partition at once.
+    virtual void test_join_encoding_batch(partition_key pk, std::span<const partition_key> nbs, std::span<EncodingResult> out) {
+        for(size_t i = 0; i < nbs.size(); i++) {
+            out[i] = test_join_encoding(pk, nbs[i]);
+        }
+    }
     
     virtual void decode(BitStreamReader& bs, cv::Mat& out_img) = 0;
 
+    // decodes the image given only the decoded mask, which contains the labels 0 ... n_partitions-1 in the 
+    // order of the partition keys. the default sets up a Multicut for decode, codecs that do not need 
+    // one can override this to skip its construction.
+    virtual void decode_from_mask(BitStreamReader& bs, const cv::Mat& mask, size_t n_partitions, cv::Mat& out_img) {
+        Multicut mc = Multicut::without_relabel(mask, n_partitions);
+        initialize(&mc, &out_img);
+        decode(bs, out_img);
+    }
+
+    // decodes the colors of a region of the image. region_mask contains a subset of the labels 0 ... n_partitions-1,
+    // out_img has its size. only codecs whose colors do not depend on the shape of the partitions can support this.
+    virtual void decode_region(BitStreamReader& bs, const cv::Mat& region_mask, size_t n_partitions, cv::Mat& out_img) {
+        throw std::runtime_error("decode_region is not supported by this partition codec");
+    }
+
     virtual void notify_init(partition_key pk) = 0;
     virtual void notify_join(partition_key pk1, partition_key pk2) = 0;
 
+    // carries the state the codec reached during optimization over to the compacted multicut 
+    // (see Multicut::compact), which replaces initialize before write_encoding. 
+    // old_to_new is the mapping returned by compact. Returns false if the codec does not support this.
+    virtual bool rebind(const Multicut* multicut, const cv::Mat* img, const std::vector<partition_key>& old_to_new) {
+        return false;
+    }
+
+    // the name of the codec and all parameters that change its streams (see Codec::make_container).
+    // empty for codecs that do not describe themselves.
+    virtual std::string config() const {
+        return "";
+    }
+
     virtual std::unique_ptr<PartitionCodecBase> clone() const = 0;
 
     virtual ~PartitionCodecBase() = default;
 
+};
+
+// Calls the optimizer-facing functions of a partition codec whose exact type is known at compile time.
+// For Codec != PartitionCodecBase, the calls are qualified, which bypasses the vtable and allows the compiler
+// to inline the codec into the optimizer's loops. The codec object must be of exactly type Codec,
+// as overrides of a further derived class would be skipped. Codec = PartitionCodecBase dispatches virtually.
+template<typename Codec>
+struct StaticCodec {
+
+    static_assert(std::is_base_of_v<PartitionCodecBase, Codec>);
+    static constexpr bool is_virtual = std::is_same_v<Codec, PartitionCodecBase>;
+
+    Codec* codec;
+
+    explicit StaticCodec(PartitionCodecBase* partition_codec) : codec(static_cast<Codec*>(partition_codec)) {
+        if(!is_virtual && typeid(*partition_codec) != typeid(Codec)) {
+            throw std::invalid_argument("StaticCodec: the partition codec is not of the expected type.");
+        }
+    }
+
+    void initialize(const Multicut* multicut, const cv::Mat* img) {
+        if constexpr(is_virtual) codec->initialize(multicut, img);
+        else codec->Codec::initialize(multicut, img);
+    }
+
+    EncodingResult test_encoding(partition_key pk) {
+        if constexpr(is_virtual) return codec->test_encoding(pk);
+        else return codec->Codec::test_encoding(pk);
+    }
+
+    EncodingResult test_join_encoding(partition_key pk1, partition_key pk2) {
+        if constexpr(is_virtual) return codec->test_join_encoding(pk1, pk2);
+        else return codec->Codec::test_join_encoding(pk1, pk2);
+    }
+
+    void test_join_encoding_batch(partition_key pk, std::span<const partition_key> nbs, std::span<EncodingResult> out) {
+        if constexpr(is_virtual) codec->test_join_encoding_batch(pk, nbs, out);
+        else codec->Codec::test_join_encoding_batch(pk, nbs, out);
+    }
+
+    void notify_init(partition_key pk) {
+        if constexpr(is_virtual) codec->notify_init(pk);
+        else codec->Codec::notify_init(pk);
+    }
+
+    void notify_join(partition_key pk1, partition_key pk2) {
+        if constexpr(is_virtual) codec->notify_join(pk1, pk2);
+        else codec->Codec::notify_join(pk1, pk2);
+    }
+
 };
 struct MulticutCodecBase {
-    virtual void write_encoding(BitStream& bs, const cv::Mat& mask) = 0;
+    // encodes the mask given by its edges (see EdgeMap). callers that encode the same mask with several codecs
+    // build the EdgeMap once and pass it to each of them.
+    virtual void write_edges(BitStream& bs, const EdgeMap& edges) = 0;
+    virtual void write_encoding(BitStream& bs, const cv::Mat& mask) {
+        write_edges(bs, EdgeMap(mask));
+    }
+    // the returned mask labels the partitions 0, 1, ... in the order of their first pixel (row-major),
+    // which is the order of the partition keys of Multicut(mask), unless the codec overrides relabel
     virtual cv::Mat read_mask(BitStreamReader& reader, size_t rows, size_t cols) = 0;
+
+    // codecs whose read_mask labels the partitions in another order write the mask (labeled like Multicut(mask))
+    // relabeled into that order to out and return true
+    virtual bool relabel(const cv::Mat& mask, cv::Mat& out) const {
+        return false;
+    }
+
+    // decodes the labels of the pixels in roi, as read_mask labels them, and sets n_partitions to the number of
+    // partitions of the whole mask. the default decodes the whole mask.
+    virtual cv::Mat read_region(BitStreamReader& reader, size_t rows, size_t cols, const cv::Rect& roi, size_t& n_partitions) {
+        cv::Mat mask = read_mask(reader, rows, cols);
+        partition_key max_label = 0;
+        for(int r = 0; r < mask.rows; r++) {
+            const partition_key* row = mask.ptr<partition_key>(r);
+            max_label = std::max(max_label, *std::max_element(row, row + mask.cols));
+        }
+        n_partitions = max_label + 1;
+        return mask(roi).clone();
+    }
+
+    // true if read_region only reads the parts of the stream needed for roi
+    virtual bool random_access() const {
+        return false;
+    }
+
+    // the name of the codec and all parameters that change its streams (see Codec::make_container).
+    // empty for codecs that do not describe themselves.
+    virtual std::string config() const {
+        return "";
+    }
+
     virtual std::unique_ptr<MulticutCodecBase> clone() const = 0;
     virtual ~MulticutCodecBase() = default;
 };
\ No newline at end of file
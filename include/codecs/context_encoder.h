@@ -3,10 +3,17 @@
 #include "unordered_map"
 #include "map"
 #include "arithmetic.h"
+#include "binary_range_coder.h"
+#include "rans.h"
 #include "ArithmeticCoder.hpp"
 #include "FrequencyTable.hpp"
 #include "diagnostics.h"
 
+#include <array>
+#include <limits>
+#include <cassert>
+#include <stdexcept>
+
 const int DEFAULT_WEIGHT = 10;
 
 class ContextBasedEncoder {
@@ -42,22 +49,34 @@ public:
 
 class NaiveEncoder : public ContextBasedEncoder {
 
-    using ContextBasedEncoder::ContextBasedEncoder;
+    BitWriter writer;
 
 public:
+    NaiveEncoder(BitStream& bs) : ContextBasedEncoder(bs), writer(bs) {}
+
     void encode_bit(bool data, const std::vector<bool>& context = {}) {
-        bs.append<bool>(data, 1);
+        writer.write_bit(data);
+    }
+
+    void finalize() {
+        writer.finish();
     }
 
 };
 
 class NaiveDecoder : public ContextBasedDecoder {
     
-    using ContextBasedDecoder::ContextBasedDecoder;
+    BitReader bit_reader;
 
 public:
+    NaiveDecoder(BitStreamReader& reader) : ContextBasedDecoder(reader), bit_reader(reader) {}
+
     bool decode_bit(const std::vector<bool>& context = {}) {
-        return reader.read_bit();
+        return bit_reader.read_bit();
+    }
+
+    void finalize() {
+        bit_reader.finish();
     }
 
 };
@@ -120,7 +139,8 @@ public:
 
 };
 
-class BlockEncoder : public ArithmeticContextBasedEncoder {
+// Packs block_size bits into one symbol and codes the symbols against a static table with rANS (see rans.h).
+class BlockEncoder : public ContextBasedEncoder {
 
     size_t block_size; // bits per block
     size_t freq_precision; // bits used to encode freqs
@@ -131,7 +151,7 @@ class BlockEncoder : public ArithmeticContextBasedEncoder {
 public:
 
     BlockEncoder(BitStream& bs, size_t block_size, size_t freq_precision) 
-        : ArithmeticContextBasedEncoder(bs), block_size(block_size), freq_precision(freq_precision) {
+        : ContextBasedEncoder(bs), block_size(block_size), freq_precision(freq_precision) {
 
         }
 
@@ -190,46 +210,47 @@ public:
             }
         }
 
-        SimpleFrequencyTable freqs(encode_counts);
+        RansFrequencyTable freqs(encode_counts);
 
+        RansEncoder encoder;
         for(int i = 0; i < symbols.size(); i++) {
             encoder.write(freqs, symbols[i]);
         }
-
-        ArithmeticContextBasedEncoder::finalize();
+        encoder.finish(bs);
     }
 
 };
 
-class BlockDecoder : public ArithmeticContextBasedDecoder {
+class BlockDecoder : public ContextBasedDecoder {
 
     size_t block_size;
     size_t freq_precision;
     
-    SimpleFrequencyTable freqs;
+    RansFrequencyTable freqs;
+    RansDecoder decoder;
     std::vector<bool> current_symbol;
 
 public:
     BlockDecoder(BitStreamReader& reader, size_t block_size, size_t freq_precision) 
-        : ArithmeticContextBasedDecoder(reader), 
+        : ContextBasedDecoder(reader), 
         block_size(block_size), 
-        freq_precision(freq_precision), 
-        freqs(std::vector<uint32_t>(0b1 << block_size)) {
+        freq_precision(freq_precision) {
 
     }
 
     void initialize() {
         uint64_t n_symbols = 0b1 << block_size;
-        for(int i = 0; i < n_symbols; i++) {
-            freqs.set(i, reader.read32u(freq_precision));
+        std::vector<uint32_t> counts(n_symbols);
+        for(uint32_t& count : counts) {
+            count = reader.read32u(freq_precision);
         }
-
-        ArithmeticContextBasedDecoder::initialize();
+        freqs = RansFrequencyTable(counts);
+        decoder = RansDecoder(reader);
     }
 
     bool decode_bit(const std::vector<bool>& context = {}) {
         if(current_symbol.empty()) {
-            uint64_t packed_symbol = decoder->read(freqs);
+            uint64_t packed_symbol = decoder.read(freqs);
             for(int b = block_size - 1; b >= 0; b--) {
                 bool data = (packed_symbol >> b) & 0b1;
                 current_symbol.push_back(data);
@@ -240,56 +261,97 @@ public:
         return res;
     }
 
-    void finalize() {
-        ArithmeticContextBasedDecoder::finalize();
-    }
-
 };
 
-struct SlidingWindowHistory {
+// Counts the transitions (the last context_size bits -> the next bit) among the most recent max_window_size bits.
+// The bits are kept in a packed ring buffer, so that adding a bit and evicting the oldest transition are O(1)
+// and free of data dependent branches. Count sets the width of the counters, which have to be able to hold
+// max_window_size. A max_window_size above MAX_RING_BITS is treated as unbounded, all transitions are counted.
+template<typename Count>
+struct BasicSlidingWindowHistory {
+
+    static constexpr size_t MAX_RING_BITS = size_t(1) << 30;
 
     size_t max_window_size;
-    std::deque<bool> window;
     size_t context_size;
 
-    std::vector<uint32_t[2]> freqs;
+    std::vector<std::array<Count, 2>> freqs;
     uint32_t context_mask;
 
+private:
+
+    bool bounded;
+    std::vector<uint64_t> ring; // bit i of the history is stored at bit (i & ring_mask) 
+    uint64_t ring_mask = 0;
+    uint64_t n_added = 0;
+
 public: 
 
-    size_t current_context = 0;
-    size_t last_context = 0;
+    size_t current_context = 0; // the last context_size bits
+    size_t last_context = 0; // the context of the oldest transition in the window
 
-    SlidingWindowHistory(size_t max_window_size, size_t context_size) : 
+    BasicSlidingWindowHistory(size_t max_window_size, size_t context_size) : 
         max_window_size(max_window_size),
         context_size(context_size),
-        freqs(0b1 << context_size),
-        context_mask((0b1 << context_size) - 1) {
+        freqs(0b1 << context_size, {0, 0}),
+        context_mask((0b1 << context_size) - 1),
+        bounded(max_window_size <= MAX_RING_BITS) {
+
+        if(bounded && max_window_size > std::numeric_limits<Count>::max()) {
+            throw std::invalid_argument("BasicSlidingWindowHistory: the counters are too narrow for the window size");
+        }
 
+        if(bounded) {
+            size_t ring_bits = 64;
+            while(ring_bits < max_window_size) ring_bits *= 2;
+            ring.assign(ring_bits / 64, 0);
+            ring_mask = ring_bits - 1;
+        }
     }
 
     void add(bool b) {
 
-        if(window.size() >= context_size) {
-            freqs[current_context][b]++;
-        }
+        freqs[current_context][b] += Count(n_added >= context_size);
 
-        if(window.size() == max_window_size) {
-            bool new_delete_bit = window.at(max_window_size - context_size - 1);
-            freqs[last_context][new_delete_bit]--;
-            last_context = ((last_context << 1) & context_mask) | new_delete_bit;
-            window.pop_back();
-        }
-        else if(window.size() >= (max_window_size - context_size)) {
-            last_context = (last_context << 1) | window.at(max_window_size - context_size - 1);
+        if(bounded) {
+            // the transition to bit j leaves the window. j is negative (and wraps around) while the window 
+            // is filling up, the ring then yields zeros, which leaves last_context at 0.
+            uint64_t j = n_added - max_window_size + context_size;
+            bool old = (ring[(j & ring_mask) >> 6] >> (j & 63)) & 1;
+            freqs[last_context][old] -= Count(n_added >= max_window_size);
+            last_context = ((last_context << 1) & context_mask) | old;
+
+            uint64_t& word = ring[(n_added & ring_mask) >> 6];
+            word = (word & ~(uint64_t(1) << (n_added & 63))) | (uint64_t(b) << (n_added & 63));
         }
 
         current_context = ((current_context << 1) & context_mask) | b;
-        window.push_front(b);
+        n_added++;
+    }
+
+    // the probability of a 0 bit in the current context (see binary_range_coder).
+    // contexts in which a bit has not been seen yet get a small, non-zero probability for it.
+    uint32_t prob() const {
+        uint32_t count_0 = freqs[current_context][0];
+        uint32_t count_1 = freqs[current_context][1];
+
+        if(count_0 == 0 && count_1 == 0) {
+            count_0 = 1;
+            count_1 = 1;
+        }
+        else if(count_0 == 0) {
+            count_0 = 1;
+            count_1 = DEFAULT_WEIGHT;
+        }
+        else if(count_1 == 0) {
+            count_0 = DEFAULT_WEIGHT;
+            count_1 = 1;
+        }
 
+        return binary_range_coder::prob_from_counts(count_0, count_1);
     }
 
-    std::vector<uint32_t> get_current_context_freqs() {
+    std::vector<uint32_t> get_current_context_freqs() const {
         uint32_t count_0 = freqs[current_context][0];
         uint32_t count_1 = freqs[current_context][1];
         return {count_0, count_1};
@@ -297,125 +359,136 @@ public:
 
 };
 
-class AdaptiveBitwiseEncoder : public ArithmeticContextBasedEncoder {
-
-    // how many bits in the past to consider
-    // current probability distribution will be estimated from these bits
-    // can be set to large number (i.e. 2^63)  n   to consider all previous transitions
-    size_t window_size;
+using SlidingWindowHistory = BasicSlidingWindowHistory<uint32_t>;
 
-    // how many preceeding symbols to consider
-    // i.e. order 0 -> consider only bit freuencies p(0) p(1)
-    // order 1 -> consider p(0|0), p(0|1), p(1|0), p(1|1)
-    // order 2 -> consider p(0|00), ... p(1|11)
-    size_t order;
-    SlidingWindowHistory window;
+// An alternative to the exact window of BasicSlidingWindowHistory: every context keeps the probability of a 0 bit,
+// which moves by 2^-shift of the distance towards every bit seen in that context. This is an exponentially 
+// decaying average over the past bits of the context. It needs no buffer and adapts faster to local statistics.
+struct DecayingBitHistory {
 
-public:
+    size_t context_size;
+    uint32_t shift;
+    uint32_t context_mask;
+    std::vector<uint16_t> probs; // scaled to binary_range_coder::PROB_BITS, stays within (0, PROB_ONE) for shift >= 1
 
-    AdaptiveBitwiseEncoder(BitStream& bs, size_t window_size, size_t order) :
-        ArithmeticContextBasedEncoder(bs), 
-        window_size(window_size), 
-        order(order), 
-        window(window_size, order) {
+    size_t current_context = 0;
 
-        }
+    DecayingBitHistory(size_t context_size, uint32_t shift) :
+        context_size(context_size),
+        shift(shift),
+        context_mask((0b1 << context_size) - 1),
+        probs(0b1 << context_size, binary_range_coder::PROB_ONE / 2) {
+        assert(shift >= 1 && shift < binary_range_coder::PROB_BITS);
+    }
 
-    void initialize() {
+    void add(bool b) {
+        uint32_t p = probs[current_context];
+        uint32_t up = (binary_range_coder::PROB_ONE - p) >> shift;
+        uint32_t down = p >> shift;
+        uint32_t mask = -uint32_t(b);
+        probs[current_context] = p + (up & ~mask) - (down & mask);
+        current_context = ((current_context << 1) & context_mask) | b;
+    }
 
+    uint32_t prob() const {
+        return probs[current_context];
     }
 
-    void encode_bit(bool data, const std::vector<bool>& context = {}) {
+};
 
-        auto freqs = window.get_current_context_freqs();
+// codes every bit with the probability a History (i.e. SlidingWindowHistory or DecayingBitHistory)
+// has learned from the previous bits. Encoder and decoder update their histories identically.
+template<typename History>
+class HistoryBitwiseEncoder : public ContextBasedEncoder {
 
-        if(freqs[0] == 0 && freqs[1] == 0) {
-            freqs[0] = 1;
-            freqs[1] = 1;
-        }
-        else if(freqs[0] == 0) {
-            freqs[0] = 1;
-            freqs[1] = DEFAULT_WEIGHT;
-        }
-        else if(freqs[1] == 0) {
-            freqs[0] = DEFAULT_WEIGHT;
-            freqs[1] = 1;
-        }
+    History history;
+    BinaryRangeEncoder encoder;
+
+public:
+
+    HistoryBitwiseEncoder(BitStream& bs, History history) : 
+        ContextBasedEncoder(bs), 
+        history(std::move(history)) {
 
-        SimpleFrequencyTable f({freqs[0], freqs[1]});
-        encoder.write(f, data);
-        window.add(data);
+    }
 
+    void encode_bit(bool data, const std::vector<bool>& context = {}) {
+        encoder.encode(data, history.prob());
+        history.add(data);
     }
 
     void finalize() {
-        ArithmeticContextBasedEncoder::finalize();
+        encoder.finish(bs);
     }
 
 };
 
-class AdaptiveBitwiseDecoder : public ArithmeticContextBasedDecoder {
-
-    // see AdaptiveBitwiseEncoder
-    size_t window_size;
-
-    size_t order;
-    std::vector<uint32_t> symbol_counts;
-    SlidingWindowHistory window;
+template<typename History>
+class HistoryBitwiseDecoder : public ContextBasedDecoder {
 
-    int ctr = 0;
+    History history;
+    BinaryRangeDecoder decoder;
 
 public:
 
-    AdaptiveBitwiseDecoder(BitStreamReader& reader, size_t window_size, size_t order) :
-        ArithmeticContextBasedDecoder(reader), 
-        window_size(window_size), 
-        order(order), 
-        window(window_size, order) {
+    HistoryBitwiseDecoder(BitStreamReader& reader, History history) :
+        ContextBasedDecoder(reader), 
+        history(std::move(history)) {
 
     }
 
     void initialize() {
-        ArithmeticContextBasedDecoder::initialize();
+        decoder = BinaryRangeDecoder(reader);
     }
 
     bool decode_bit(const std::vector<bool>& context = {}) {
+        bool data = decoder.decode(history.prob());
+        history.add(data);
+        return data;
+    }
 
-        auto freqs = window.get_current_context_freqs();
+};
 
-        if(freqs[0] == 0 && freqs[1] == 0) {
-            freqs[0] = 1;
-            freqs[1] = 1;
-            ctr++;
-        }
-        else if(freqs[0] == 0) {
-            freqs[0] = 1;
-            freqs[1] = DEFAULT_WEIGHT;
-            ctr++;
-        }
-        else if(freqs[1] == 0) {
-            freqs[0] = DEFAULT_WEIGHT;
-            freqs[1] = 1;
-            ctr++;
-        }
+class AdaptiveBitwiseEncoder : public HistoryBitwiseEncoder<SlidingWindowHistory> {
 
-        SimpleFrequencyTable f({freqs[0], freqs[1]});
-        bool data = decoder->read(f);
-        window.add(data);
-        return data;
+public:
+
+    // window_size: how many bits in the past to consider
+    // current probability distribution will be estimated from these bits
+    // can be set to large number (i.e. 2^63)  n   to consider all previous transitions
+    // order: how many preceeding symbols to consider
+    // i.e. order 0 -> consider only bit freuencies p(0) p(1)
+    // order 1 -> consider p(0|0), p(0|1), p(1|0), p(1|1)
+    // order 2 -> consider p(0|00), ... p(1|11)
+    AdaptiveBitwiseEncoder(BitStream& bs, size_t window_size, size_t order) :
+        HistoryBitwiseEncoder(bs, SlidingWindowHistory(window_size, order)) {
 
     }
 
-    void finalize() {
-        ArithmeticContextBasedDecoder::finalize();
+};
+
+class AdaptiveBitwiseDecoder : public HistoryBitwiseDecoder<SlidingWindowHistory> {
+
+public:
+
+    // see AdaptiveBitwiseEncoder
+    AdaptiveBitwiseDecoder(BitStreamReader& reader, size_t window_size, size_t order) :
+        HistoryBitwiseDecoder(reader, SlidingWindowHistory(window_size, order)) {
+
     }
 
 };
+
 struct AbstractCodecFactory {
     virtual std::unique_ptr<AbstractCodecFactory> clone() const = 0;
     virtual std::unique_ptr<ContextBasedEncoder> make_encoder(BitStream& bs) const = 0;
     virtual std::unique_ptr<ContextBasedDecoder> make_decoder(BitStreamReader& reader) const = 0;
 
+    // the kind of the factory and its parameters, empty if unknown (see MulticutCodecBase::config)
+    virtual std::string config() const {
+        return "";
+    }
+
     virtual ~AbstractCodecFactory() = default;
 };
 
@@ -432,10 +505,22 @@ struct ConcreteCodecFactory : public AbstractCodecFactory {
     std::unique_ptr<AbstractCodecFactory> clone() const {
         return std::make_unique<ConcreteCodecFactory>(*this);
     }
+
+    std::string config() const;
 };
 
+template<typename ConcreteEncoder, typename ConcreteDecoder>
+std::string ConcreteCodecFactory<ConcreteEncoder, ConcreteDecoder>::config() const {
+    return "";
+}
+
 using NaiveCodecFactory = ConcreteCodecFactory<NaiveEncoder, NaiveDecoder>;
 
+template<>
+inline std::string NaiveCodecFactory::config() const {
+    return "Naive";
+}
+
 struct BlockCodecFactory : AbstractCodecFactory {
 
     size_t block_size, freq_precision;
@@ -459,6 +544,10 @@ struct BlockCodecFactory : AbstractCodecFactory {
         return std::make_unique<BlockCodecFactory>(*this);
     }
 
+    std::string config() const {
+        return "Block(" + std::to_string(block_size) + "," + std::to_string(freq_precision) + ")";
+    }
+
 };
 
 struct AdapativeBitwiseCodecFactory : AbstractCodecFactory {
@@ -482,4 +571,35 @@ struct AdapativeBitwiseCodecFactory : AbstractCodecFactory {
         return std::make_unique<AdapativeBitwiseCodecFactory>(*this);
     }
 
+    std::string config() const {
+        return "AdaptiveBitwise(" + std::to_string(window_size) + "," + std::to_string(order) + ")";
+    }
+
+};
+
+struct DecayingBitwiseCodecFactory : AbstractCodecFactory {
+
+    size_t order;
+    uint32_t shift; // adaptation rate, see DecayingBitHistory
+
+    DecayingBitwiseCodecFactory(size_t order, uint32_t shift) : 
+        order(order), 
+        shift(shift) {}
+
+    std::unique_ptr<ContextBasedEncoder> make_encoder(BitStream& bs) const {
+        return std::make_unique<HistoryBitwiseEncoder<DecayingBitHistory>>(bs, DecayingBitHistory(order, shift));
+    }
+
+    std::unique_ptr<ContextBasedDecoder> make_decoder(BitStreamReader& reader) const {
+        return std::make_unique<HistoryBitwiseDecoder<DecayingBitHistory>>(reader, DecayingBitHistory(order, shift));
+    }
+
+    std::unique_ptr<AbstractCodecFactory> clone() const {
+        return std::make_unique<DecayingBitwiseCodecFactory>(*this);
+    }
+
+    std::string config() const {
+        return "DecayingBitwise(" + std::to_string(order) + "," + std::to_string(shift) + ")";
+    }
+
 };
\ No newline at end of file
@@ -47,6 +47,16 @@ namespace ensemble {
         uint32_t cell_size,
         bool differential_codec
     );
+
+    // same as above for several optimization levels, which are all computed from a single optimization run
+    void preprocess_data(
+        const std::string& data_dir,
+        const std::string& out_dir,
+        const std::string& prefix,
+        const std::vector<double>& optimization_levels,
+        uint32_t cell_size,
+        bool differential_codec
+    );
     
     
     extern std::vector<std::string> default_target_labels;
@@ -81,6 +91,11 @@ namespace ensemble {
             }
         }
 
+        // the features are computed from the partitions, which have to be labeled first
+        virtual void write_edges(BitStream& bs, const EdgeMap& edges) {
+            write_encoding(bs, mask_from_edges(edges));
+        }
+
         virtual cv::Mat read_mask(BitStreamReader& reader, size_t rows, size_t cols) {
             bool pred = reader.read_bit();
             if(pred == 0) return bc->read_mask(reader, rows, cols);
@@ -3,6 +3,54 @@
 #include "multicut.h"
 #include "arithmetic.h"
 
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Colors every pixel with the palette entry of its label: out_img(r, c) = palette[mask(r, c)].
+// This replaces walking the point lists of every partition with a sequential pass over the rows (in parallel).
+// The mask has to contain the labels 0 ... palette.size()-1, out_img has to be allocated as CV_8UC3.
+inline void paint_palette(const cv::Mat& mask, const std::vector<cv::Vec3b>& palette, cv::Mat& out_img) {
+
+#ifdef __AVX2__
+    // the palette padded to 4 bytes per color, so that 8 colors can be fetched by a single gather
+    std::vector<uint32_t> palette32(palette.size());
+    for(size_t i = 0; i < palette.size(); i++) {
+        palette32[i] = palette[i][0] | (palette[i][1] << 8) | (palette[i][2] << 16);
+    }
+#endif
+
+    #pragma omp parallel for schedule(static)
+    for(int r = 0; r < mask.rows; r++) {
+        const partition_key* labels = mask.ptr<partition_key>(r);
+        cv::Vec3b* out = out_img.ptr<cv::Vec3b>(r);
+        int c = 0;
+
+#ifdef __AVX2__
+        // drops the padding byte of each color, packing the 4 colors of a 128 bit lane into its lower 12 bytes
+        const __m256i pack = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+        );
+        uint8_t* out_bytes = reinterpret_cast<uint8_t*>(out);
+
+        // each iteration writes 28 bytes for 8 pixels, the surplus is overwritten by the next iteration
+        for(; c + 10 <= mask.cols; c += 8) {
+            __m256i idx = _mm256_loadu_si256((const __m256i*)(labels + c));
+            __m256i colors = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)palette32.data(), idx, 4), pack);
+            _mm_storeu_si128((__m128i*)(out_bytes + 3 * c), _mm256_castsi256_si128(colors));
+            _mm_storeu_si128((__m128i*)(out_bytes + 3 * c + 12), _mm256_extracti128_si256(colors, 1));
+        }
+#endif
+
+        for(; c < mask.cols; c++) {
+            out[c] = palette[labels[c]];
+        }
+    }
+}
+
 struct MeanCodec : PartitionCodecBase {
 
     MeanCodec() {
@@ -10,106 +58,143 @@ struct MeanCodec : PartitionCodecBase {
     }
 
     const cv::Mat* img;
-    const std::vector<PartitionData>* partitions;
-    std::vector<cv::Vec3f> key_to_mean_color;
-    std::vector<float> key_to_error;
-
-    virtual void initialize(const std::vector<PartitionData>* partitions, const cv::Mat* img) {
-        (this->partitions) = partitions;
+    const Multicut* multicut;
+
+    // per partition sufficient statistics: the pixel count, the sums of the channels and the sum of the squared
+    // channels. They are exact, as all values are integers below 2^53, and make the mean and error of a partition,
+    // as well as joins, O(1). Stored as separate arrays so that many partitions can be processed at once.
+    std::vector<double> count;
+    std::vector<double> sum_b, sum_g, sum_r;
+    std::vector<double> sum_sq;
+    bool has_statistics = false;
+
+    virtual void initialize(const Multicut* multicut, const cv::Mat* img) {
+        (this->multicut) = multicut;
         (this->img = img);
-        key_to_mean_color.clear();
-        key_to_error.clear();
-        key_to_mean_color.resize(partitions->size());
-        key_to_error.resize(partitions->size());
+        has_statistics = false; // collected on first use, decoding does not need them
     }
 
     virtual void NOINLINE write_encoding(BitStream& bs) {
-        for(partition_key pk = 0; pk < partitions->size(); pk++) {
-            cv::Vec3b mean_color = init_mean_color(pk);
-            bs.append(mean_color[0], 8);
-            bs.append(mean_color[1], 8);
-            bs.append(mean_color[2], 8);
+        collect_statistics();
+        BitWriter writer(bs);
+        for(partition_key pk = 0; pk < multicut->partitions.size(); pk++) {
+            cv::Vec3b mean_color = this->mean_color(pk);
+            writer.write((uint32_t(mean_color[0]) << 16) | (uint32_t(mean_color[1]) << 8) | mean_color[2], 24);
         }
     }
 
     virtual EncodingResult NOINLINE test_encoding(partition_key pk) {
-        return {24, key_to_error.at(pk)};
+        return {24, float(error(pk))};
     }
 
     virtual EncodingResult NOINLINE test_join_encoding(partition_key pk1, partition_key pk2) {
-        const cv::Vec3f& old_mean1 = key_to_mean_color.at(pk1);
-        const cv::Vec3f& old_mean2 = key_to_mean_color.at(pk2);
-
-        float n = partitions->at(pk1).points.size() + partitions->at(pk2).points.size();
-        float f1 = partitions->at(pk1).points.size() / n;
-        float f2 = partitions->at(pk2).points.size() / n;
-        cv::Vec3f new_mean = f1 * old_mean1 + f2 * old_mean2;
-
-        // see proof.md
-        float   lb_mean_1 = (old_mean1[0] - new_mean[0]) * (old_mean1[0] - new_mean[0]);
-                lb_mean_1 += (old_mean1[1] - new_mean[1]) * (old_mean1[1] - new_mean[1]);
-                lb_mean_1 += (old_mean1[2] - new_mean[2]) * (old_mean1[2] - new_mean[2]);
-                lb_mean_1 *= partitions->at(pk1).points.size();
+        return {24, float(join_error(pk1, pk2))};
+    }
 
-        float   lb_mean_2 = (old_mean2[0] - new_mean[0]) * (old_mean2[0] - new_mean[0]);
-                lb_mean_2 += (old_mean2[1] - new_mean[1]) * (old_mean2[1] - new_mean[1]);
-                lb_mean_2 += (old_mean2[2] - new_mean[2]) * (old_mean2[2] - new_mean[2]);
-                lb_mean_2 *= partitions->at(pk2).points.size();
+    virtual void test_join_encoding_batch(partition_key pk, std::span<const partition_key> nbs, std::span<EncodingResult> out) {
+        size_t i = 0;
+
+#ifdef __AVX2__
+        const __m256d c1 = _mm256_set1_pd(count[pk]);
+        const __m256d b1 = _mm256_set1_pd(sum_b[pk]);
+        const __m256d g1 = _mm256_set1_pd(sum_g[pk]);
+        const __m256d r1 = _mm256_set1_pd(sum_r[pk]);
+        const __m256d q1 = _mm256_set1_pd(sum_sq[pk]);
+        alignas(32) double new_err[4];
+
+        for(; i + 4 <= nbs.size(); i += 4) {
+            __m128i idx = _mm_loadu_si128((const __m128i*)(nbs.data() + i));
+            __m256d n = _mm256_add_pd(c1, _mm256_i32gather_pd(count.data(), idx, 8));
+            __m256d b = _mm256_add_pd(b1, _mm256_i32gather_pd(sum_b.data(), idx, 8));
+            __m256d g = _mm256_add_pd(g1, _mm256_i32gather_pd(sum_g.data(), idx, 8));
+            __m256d r = _mm256_add_pd(r1, _mm256_i32gather_pd(sum_r.data(), idx, 8));
+            __m256d q = _mm256_add_pd(q1, _mm256_i32gather_pd(sum_sq.data(), idx, 8));
+
+            __m256d sq_sum = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(g, g)), _mm256_mul_pd(r, r));
+            __m256d res = _mm256_sub_pd(q, _mm256_div_pd(sq_sum, n));
+            _mm256_store_pd(new_err, _mm256_max_pd(res, _mm256_setzero_pd()));
+
+            for(int k = 0; k < 4; k++) {
+                out[i + k] = {24, float(new_err[k])};
+            }
+        }
+#endif
 
-        float new_err = key_to_error.at(pk1) + key_to_error.at(pk2) + lb_mean_1 + lb_mean_2;
-        return {24, new_err};
+        for(; i < nbs.size(); i++) {
+            out[i] = {24, float(join_error(pk, nbs[i]))};
+        }
     }
 
     virtual void decode(BitStreamReader& bs, cv::Mat& out_img) {
+        paint_palette(multicut->mask, read_palette(bs, multicut->partitions.size()), out_img);
+    }
 
-        for(partition_key pk = 0; pk < partitions->size(); pk++) {
-            int b = bs.read8u();
-            int g = bs.read8u();
-            int r = bs.read8u();
-            cv::Vec3b color(b, g, r);
+    virtual void decode_from_mask(BitStreamReader& bs, const cv::Mat& mask, size_t n_partitions, cv::Mat& out_img) {
+        paint_palette(mask, read_palette(bs, n_partitions), out_img);
+    }
 
-            for(const cv::Point2i& p : partitions->at(pk).points) {
-                out_img.at<cv::Vec3b>(p) = color;
-            }
+    // the colors have a fixed width, so only the colors of the labels in the region are read
+    virtual void decode_region(BitStreamReader& bs, const cv::Mat& region_mask, size_t n_partitions, cv::Mat& out_img) {
+        std::vector<partition_key> labels;
+        for(int r = 0; r < region_mask.rows; r++) {
+            const partition_key* row = region_mask.ptr<partition_key>(r);
+            labels.insert(labels.end(), row, row + region_mask.cols);
         }
+        std::sort(labels.begin(), labels.end());
+        labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
 
+        std::vector<cv::Vec3b> palette(labels.size());
+        for(size_t i = 0; i < labels.size(); i++) {
+            uint32_t bgr = bs.bs.read<uint32_t>(bs.head + 24 * size_t(labels[i]), 24);
+            palette[i] = cv::Vec3b(bgr >> 16, (bgr >> 8) & 0xFF, bgr & 0xFF);
+        }
+        bs.head += 24 * n_partitions;
+
+        cv::Mat compact(region_mask.rows, region_mask.cols, CV_32SC1);
+        for(int r = 0; r < region_mask.rows; r++) {
+            const partition_key* row = region_mask.ptr<partition_key>(r);
+            partition_key* out = compact.ptr<partition_key>(r);
+            for(int c = 0; c < region_mask.cols; c++) {
+                out[c] = std::lower_bound(labels.begin(), labels.end(), row[c]) - labels.begin();
+            }
+        }
+        paint_palette(compact, palette, out_img);
     }
 
     // informs the codec that partition pk is about to be created
     virtual void notify_init(partition_key pk) {
-        key_to_mean_color.at(pk) = init_mean_color(pk);
-        key_to_error.at(pk) = init_error(pk);
+        collect_statistics();
     }
 
     // inform the codec, that pk1 and pk2 are about to be joined
-    // this updates the mean color and error for the partition
+    // this updates the statistics of both partitions to those of the joint partition
     virtual void notify_join(partition_key pk1, partition_key pk2) {
+        for(auto* v : {&count, &sum_b, &sum_g, &sum_r, &sum_sq}) {
+            double joint = (*v)[pk1] + (*v)[pk2];
+            (*v)[pk1] = joint;
+            (*v)[pk2] = joint;
+        }
+    }
 
-        const cv::Vec3f& old_mean1 = key_to_mean_color.at(pk1);
-        const cv::Vec3f& old_mean2 = key_to_mean_color.at(pk2);
-
-        float n = partitions->at(pk1).points.size() + partitions->at(pk2).points.size();
-        float f1 = partitions->at(pk1).points.size() / n;
-        float f2 = partitions->at(pk2).points.size() / n;
-        cv::Vec3f new_mean = f1 * old_mean1 + f2 * old_mean2;
-        key_to_mean_color.at(pk1) = new_mean;
-        key_to_mean_color.at(pk2) = new_mean;
-
-        // see proof.md
-        float   lb_mean_1 = (old_mean1[0] - new_mean[0]) * (old_mean1[0] - new_mean[0]);
-                lb_mean_1 += (old_mean1[1] - new_mean[1]) * (old_mean1[1] - new_mean[1]);
-                lb_mean_1 += (old_mean1[2] - new_mean[2]) * (old_mean1[2] - new_mean[2]);
-                lb_mean_1 *= partitions->at(pk1).points.size();
-
-        float   lb_mean_2 = (old_mean2[0] - new_mean[0]) * (old_mean2[0] - new_mean[0]);
-                lb_mean_2 += (old_mean2[1] - new_mean[1]) * (old_mean2[1] - new_mean[1]);
-                lb_mean_2 += (old_mean2[2] - new_mean[2]) * (old_mean2[2] - new_mean[2]);
-                lb_mean_2 *= partitions->at(pk2).points.size();
+    // the statistics of the joint partitions are kept, only their keys change
+    virtual bool rebind(const Multicut* multicut, const cv::Mat* img, const std::vector<partition_key>& old_to_new) {
+        if(!has_statistics) return false;
+        (this->multicut) = multicut;
+        (this->img = img);
 
-        float new_err = key_to_error.at(pk1) + key_to_error.at(pk2) + lb_mean_1 + lb_mean_2;
-        key_to_error.at(pk1) = new_err;
-        key_to_error.at(pk2) = new_err;
+        size_t n = multicut->partitions.size();
+        for(auto* v : {&count, &sum_b, &sum_g, &sum_r, &sum_sq}) {
+            std::vector<double> remapped(n);
+            for(partition_key pk = 0; pk < old_to_new.size(); pk++) {
+                if(old_to_new[pk] != -1) remapped[old_to_new[pk]] = (*v)[pk];
+            }
+            v->swap(remapped);
+        }
+        return true;
+    }
 
+    virtual std::string config() const {
+        return "MeanCodec";
     }
 
     virtual std::unique_ptr<PartitionCodecBase> clone() const {
@@ -118,31 +203,79 @@ struct MeanCodec : PartitionCodecBase {
 
 protected:
 
-    virtual float NOINLINE init_error(partition_key pk) {
+    // reads the colors of all partitions, as written by write_encoding
+    virtual std::vector<cv::Vec3b> read_palette(BitStreamReader& bs, size_t n_partitions) {
+        std::vector<cv::Vec3b> palette(n_partitions);
+        BitReader reader(bs);
+        for(cv::Vec3b& color : palette) {
+            uint32_t bgr = reader.read(24);
+            color = cv::Vec3b(bgr >> 16, (bgr >> 8) & 0xFF, bgr & 0xFF);
+        }
+        return palette;
+    }
 
-        float error = 0;
-        const cv::Vec3f& color = key_to_mean_color.at(pk);
+    // the squared error of encoding the partition with its mean color: sum(|p|^2) - |sum(p)|^2 / n
+    static double moment_error(double n, double b, double g, double r, double sq) {
+        return std::max(0.0, sq - (b * b + g * g + r * r) / n); // clamped, the difference may round below zero
+    }
 
-        for(const cv::Point2i& p : partitions->at(pk).points) {
-            const cv::Vec3b& p_color = img->at<cv::Vec3b>(p);
-            float a = float(color[0]) - float(p_color[0]);
-            float b = float(color[1]) - float(p_color[1]);
-            float c = float(color[2]) - float(p_color[2]);
-            error += a*a + b*b + c*c;
-        }
+    double error(partition_key pk) const {
+        return moment_error(count[pk], sum_b[pk], sum_g[pk], sum_r[pk], sum_sq[pk]);
+    }
 
-        return error;
+    // the error of the partition resulting from joining pk1 and pk2
+    double join_error(partition_key pk1, partition_key pk2) const {
+        return moment_error(
+            count[pk1] + count[pk2], 
+            sum_b[pk1] + sum_b[pk2], 
+            sum_g[pk1] + sum_g[pk2], 
+            sum_r[pk1] + sum_r[pk2], 
+            sum_sq[pk1] + sum_sq[pk2]
+        );
+    }
+
+    cv::Vec3f mean_color(partition_key pk) const {
+        cv::Vec3d total_color(sum_b[pk], sum_g[pk], sum_r[pk]);
+        total_color /= (int32_t)count[pk];
+        return total_color;
     }
 
-    virtual cv::Vec3f NOINLINE init_mean_color(partition_key pk) {
-        cv::Vec3d total_color(0, 0, 0);
+    // fills the statistics of all partitions in a single sweep over the image.
+    // relies on the mask of the multicut, which is up to date before the first join (also in pixel list mode).
+    void NOINLINE collect_statistics() {
+        if(has_statistics) return;
+        has_statistics = true;
 
-        for(const cv::Point2i& p : partitions->at(pk).points) {
-            total_color += img->at<cv::Vec3b>(p);
+        size_t n = multicut->partitions.size();
+        for(auto* v : {&count, &sum_b, &sum_g, &sum_r, &sum_sq}) {
+            v->assign(n, 0.0);
         }
 
-        total_color /= (int32_t)partitions->at(pk).points.size();
-        return total_color;
+        // runs of equal labels are accumulated in integer registers and flushed once per run
+        const cv::Mat& mask = multicut->mask;
+        for(int row = 0; row < mask.rows; row++) {
+            const partition_key* labels = mask.ptr<partition_key>(row);
+            const cv::Vec3b* pixels = img->ptr<cv::Vec3b>(row);
+            
+            int c = 0;
+            while(c < mask.cols) {
+                partition_key pk = labels[c];
+                int64_t run_b = 0, run_g = 0, run_r = 0, run_sq = 0;
+                int start = c;
+                for(; c < mask.cols && labels[c] == pk; c++) {
+                    int64_t b = pixels[c][0], g = pixels[c][1], r = pixels[c][2];
+                    run_b += b;
+                    run_g += g;
+                    run_r += r;
+                    run_sq += b * b + g * g + r * r;
+                }
+                count[pk] += c - start;
+                sum_b[pk] += run_b;
+                sum_g[pk] += run_g;
+                sum_r[pk] += run_r;
+                sum_sq[pk] += run_sq;
+            }
+        }
     }
 
 };
@@ -152,19 +285,21 @@ struct DifferentialMeanCodec : public MeanCodec {
 
     virtual void NOINLINE write_encoding(BitStream& bs) {
 
+        collect_statistics();
+
         std::vector<int> db; // distance to previous partition b channel 
         std::vector<int> dg; // distance from b to g channel
         std::vector<int> dr; // distance from g to r channel
 
-        cv::Vec3b first = init_mean_color(0);
+        cv::Vec3b first = mean_color(0);
         db.push_back(first[0]);
         dg.push_back(first[1] - first[0]);
         dr.push_back(first[2] - first[1]);
 
         int last_b = first[0];
 
-        for(partition_key pk = 1; pk < partitions->size(); pk++) {
-            cv::Vec3b cur = init_mean_color(pk);
+        for(partition_key pk = 1; pk < multicut->partitions.size(); pk++) {
+            cv::Vec3b cur = mean_color(pk);
             db.push_back(cur[0] - last_b);
             last_b = cur[0];
             dg.push_back(cur[1] - cur[0]);
@@ -177,7 +312,22 @@ struct DifferentialMeanCodec : public MeanCodec {
 
     }
 
-    virtual void decode(BitStreamReader& reader, cv::Mat& out_img) {
+    virtual std::string config() const {
+        return "DifferentialMeanCodec";
+    }
+
+    virtual std::unique_ptr<PartitionCodecBase> clone() const {
+        return std::make_unique<DifferentialMeanCodec>(*this);
+    }
+
+    // the colors are coded relative to each other, so the whole palette is read
+    virtual void decode_region(BitStreamReader& bs, const cv::Mat& region_mask, size_t n_partitions, cv::Mat& out_img) {
+        paint_palette(region_mask, read_palette(bs, n_partitions), out_img);
+    }
+
+protected:
+
+    virtual std::vector<cv::Vec3b> read_palette(BitStreamReader& reader, size_t n_partitions) {
 
         std::vector<int> db = decode_sequence<-255, 255>(reader, 16);
         std::vector<int> dg = decode_sequence<-255, 255>(reader, 16);
@@ -187,7 +337,7 @@ struct DifferentialMeanCodec : public MeanCodec {
 
         colors.emplace_back(db[0], dg[0] + db[0], dr[0] + dg[0] + db[0]);
 
-        for(int i = 1; i < partitions->size(); i++) {
+        for(int i = 1; i < n_partitions; i++) {
             int b = db[i] + colors[colors.size() - 1][0];
             colors.emplace_back(
                 b,
@@ -196,16 +346,7 @@ struct DifferentialMeanCodec : public MeanCodec {
             );
         }
 
-        for(partition_key pk = 0; pk < partitions->size(); pk++) {
-            for(const cv::Point2i& p : partitions->at(pk).points) {
-                out_img.at<cv::Vec3b>(p) = colors[pk];
-            }
-        }
-
-    }
-
-    virtual std::unique_ptr<PartitionCodecBase> clone() const {
-        return std::make_unique<DifferentialMeanCodec>(*this);
+        return colors;
     }
 
 };
\ No newline at end of file
@@ -5,7 +5,8 @@
 
 #include "multicut_codec.h"
 #include "context_encoder.h"
-#include "unionfind.h"
+
+#include <boost/unordered/unordered_flat_set.hpp>
 
 /*
 
@@ -33,6 +34,147 @@ required by all multicut codecs.)
 
 */
 
+// Tracks which of the vertical edges are implied while the MulticutAwareCodec codes them column by column, from
+// top to bottom. All horizontal edges are coded before, so the pixels form runs of joined pixels in each row,
+// which are joined further by the vertical joins coded so far. An edge is implied to be a join if both of its pixels
+// are in the same of these components, and implied to be a cut if there is a cut edge between the two components:
+// a horizontal cut or a vertical cut that was coded.
+// Only the components of the runs crossing the current column can be met again, so only these are kept,
+// together with the cuts between them, which needs memory in the order of the number of rows.
+// Runs to the right of the current column have not been joined with anything yet, their only cut is the one
+// to the run before them in their row, which is added once the column reaches them.
+class ImpliedEdgeFrontier {
+
+    int rows;
+    std::vector<int32_t> row_component; // the component of the run of every row that crosses the current column
+    std::vector<int32_t> parent; // union-find over the components, only the first n are in use
+    std::vector<std::vector<int32_t>> cut_neighbours; // the components with a cut to a root, possibly not roots
+    boost::unordered_flat_set<uint64_t> cuts; // the pairs of roots that have a cut between them
+    size_t n = 0;
+
+    std::vector<int32_t> new_id; // used by compact
+    std::vector<std::pair<int32_t, int32_t>> alive_cuts; // used by compact
+
+public:
+
+    enum Edge { CUT, JOIN, UNKNOWN };
+
+    explicit ImpliedEdgeFrontier(int rows) : rows(rows), row_component(rows) {
+
+    }
+
+    // moves to column c. runs cut off by a horizontal cut between columns c-1 and c are replaced by the runs starting at c.
+    void advance(const EdgeMap& edges, int c) {
+        if(c == 0) {
+            n = 0;
+            cuts.clear();
+            for(int r = 0; r < rows; r++) {
+                row_component[r] = new_component();
+            }
+            return;
+        }
+        for(int r = 0; r < rows; r++) {
+            if(!edges.horizontal(r, c - 1)) {
+                int32_t old_component = row_component[r];
+                row_component[r] = new_component();
+                add_cut(row_component[r], find(old_component));
+            }
+        }
+        compact();
+    }
+
+    // the state of the edge between (r, c) and (r+1, c) for the current column c
+    Edge implied(int r) {
+        int32_t a = find(row_component[r]);
+        int32_t b = find(row_component[r + 1]);
+        if(cuts.contains(key(a, b))) return CUT;
+        if(a == b) return JOIN;
+        return UNKNOWN;
+    }
+
+    // sets the state of an edge that was not implied
+    void set(int r, bool joined) {
+        int32_t a = find(row_component[r]);
+        int32_t b = find(row_component[r + 1]);
+        if(joined) unite(a, b);
+        else add_cut(a, b);
+    }
+
+private:
+
+    static uint64_t key(int32_t a, int32_t b) {
+        if(a > b) std::swap(a, b);
+        return (uint64_t(a) << 32) | uint32_t(b);
+    }
+
+    int32_t new_component() {
+        if(n == parent.size()) {
+            parent.emplace_back();
+            cut_neighbours.emplace_back();
+        }
+        parent[n] = n;
+        cut_neighbours[n].clear();
+        return n++;
+    }
+
+    int32_t find(int32_t x) {
+        while(parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
+
+    // a and b have to be roots
+    void add_cut(int32_t a, int32_t b) {
+        if(cuts.insert(key(a, b)).second) {
+            cut_neighbours[a].push_back(b);
+            cut_neighbours[b].push_back(a);
+        }
+    }
+
+    // a and b have to be roots. the cuts of the root with fewer of them are moved to the other one.
+    void unite(int32_t a, int32_t b) {
+        if(a == b) return;
+        if(cut_neighbours[a].size() > cut_neighbours[b].size()) std::swap(a, b);
+        parent[a] = b;
+        for(int32_t x : cut_neighbours[a]) {
+            x = find(x);
+            cuts.erase(key(a, x));
+            add_cut(b, x);
+        }
+        cut_neighbours[a].clear();
+    }
+
+    // drops the components that no run of the current column belongs to, and renumbers the others
+    void compact() {
+        new_id.assign(n, -1);
+        int32_t k = 0;
+        for(int32_t& component : row_component) {
+            int32_t root = find(component);
+            if(new_id[root] < 0) new_id[root] = k++;
+            component = new_id[root];
+        }
+
+        alive_cuts.clear();
+        for(uint64_t cut : cuts) {
+            int32_t a = new_id[cut >> 32];
+            int32_t b = new_id[uint32_t(cut)];
+            if(a >= 0 && b >= 0) alive_cuts.emplace_back(a, b);
+        }
+
+        n = 0;
+        cuts.clear();
+        for(int32_t i = 0; i < k; i++) {
+            new_component();
+        }
+        for(auto [a, b] : alive_cuts) {
+            add_cut(a, b);
+        }
+    }
+
+};
+
 
 
 
@@ -74,61 +216,28 @@ struct MulticutAwareCodec : public MulticutCodecBase {
         return codec;
     }
 
-    virtual void write_encoding(BitStream& bs, const cv::Mat& mask) {
+    virtual void write_edges(BitStream& bs, const EdgeMap& edges) {
 
         auto row_encoder = row_codec_factory->make_encoder(bs);
 
-        size_t n_bits = (mask.rows - 1) * mask.cols + mask.rows * (mask.cols - 1);
-        DisjointUnionFind df(n_bits);
-
-        auto make_key = [&](int r, int c) {
-            return r * mask.cols + c;
-        };
-
-        std::vector<bool> ctx;
-        ctx.reserve(n_bits);
-
-        for(int r = 0; r < mask.rows; r++) {
-            for(int c = 0; c < mask.cols - 1; c++) {
-                if(mask.at<partition_key>(r, c) == mask.at<partition_key>(r, c+1)) {
-                    df.make_union(make_key(r, c), make_key(r, c+1));
-                    row_encoder->encode_bit(true, ctx);
-                    ctx.push_back(true);
-                }
-                else {
-                    df.make_disjoint(make_key(r, c), make_key(r, c+1));
-                    row_encoder->encode_bit(false, ctx);
-                    ctx.push_back(false);
-                }
+        for(int r = 0; r < edges.rows; r++) {
+            for(int c = 0; c < edges.cols - 1; c++) {
+                row_encoder->encode_bit(edges.horizontal(r, c));
             }
         }
 
         row_encoder->finalize();
 
         auto col_encoder = col_codec_factory->make_encoder(bs);
-
-        for(int c = 0; c < mask.cols; c++) {
-            for(int r = 0; r < mask.rows - 1; r++) {
-                int k1 = make_key(r, c);
-                int k2 = make_key(r+1, c);
-                if(df.is_disjoint(k1, k2)) {
-                    ctx.push_back(false);
-                    continue;
-                }
-                if(df.is_union(k1, k2)) {
-                    ctx.push_back(true);
-                    continue;
-                }
-                if(mask.at<partition_key>(r, c) == mask.at<partition_key>(r+1, c)) {
-                    df.make_union(k1, k2);
-                    col_encoder->encode_bit(true, ctx);
-                    ctx.push_back(true);
-                }
-                else {
-                    df.make_disjoint(k1, k2);
-                    col_encoder->encode_bit(false, ctx);
-                    ctx.push_back(false);
-                }
+        ImpliedEdgeFrontier frontier(edges.rows);
+
+        for(int c = 0; c < edges.cols; c++) {
+            frontier.advance(edges, c);
+            for(int r = 0; r < edges.rows - 1; r++) {
+                if(frontier.implied(r) != ImpliedEdgeFrontier::UNKNOWN) continue;
+                bool edge = edges.vertical(r, c);
+                col_encoder->encode_bit(edge);
+                frontier.set(r, edge);
             }
         }
 
@@ -140,27 +249,11 @@ struct MulticutAwareCodec : public MulticutCodecBase {
         auto row_decoder = row_codec_factory->make_decoder(reader);
         row_decoder->initialize();
 
-        size_t n_bits = (rows - 1) * cols + rows * (cols - 1);
-        DisjointUnionFind df(n_bits);
-
-        std::vector<bool> ctx;
-        ctx.reserve(n_bits);
-
-        size_t n_row_edges = rows * (cols - 1);
-        auto make_key = [&](int r, int c) {
-            return r * cols + c;
-        };
+        EdgeMap edges(rows, cols);
 
         for(int r = 0; r < rows; r++) {
             for(int c = 0; c < cols - 1; c++) {
-                bool edge = row_decoder->decode_bit(ctx);
-                if(edge) {
-                    df.make_union(make_key(r, c), make_key(r, c+1));
-                } 
-                else {
-                    df.make_disjoint(make_key(r, c), make_key(r, c+1));
-                }
-                ctx.push_back(edge);
+                edges.set_horizontal(r, c, row_decoder->decode_bit());
             }
         }
 
@@ -168,42 +261,35 @@ struct MulticutAwareCodec : public MulticutCodecBase {
 
         auto col_decoder = col_codec_factory->make_decoder(reader);
         col_decoder->initialize();
+        ImpliedEdgeFrontier frontier(rows);
 
         for(int c = 0; c < cols; c++) {
+            frontier.advance(edges, c);
             for(int r = 0; r < rows - 1; r++) {
-                int k1 = make_key(r, c);
-                int k2 = make_key(r+1, c);
-                if(df.is_disjoint(k1, k2)) {
-                    ctx.push_back(false);
-                    continue;
-                }
-                if(df.is_union(k1, k2)) {
-                    ctx.push_back(true);
-                    continue;
-                }
-
-                bool edge = col_decoder->decode_bit(ctx);
-                if(edge) {
-                    df.make_union(k1, k2);
+                ImpliedEdgeFrontier::Edge implied = frontier.implied(r);
+                bool edge;
+                if(implied == ImpliedEdgeFrontier::UNKNOWN) {
+                    edge = col_decoder->decode_bit();
+                    frontier.set(r, edge);
                 }
                 else {
-                    df.make_disjoint(k1, k2);
+                    edge = implied == ImpliedEdgeFrontier::JOIN;
                 }
-                ctx.push_back(edge);
+                edges.set_vertical(r, c, edge);
             }
         }
 
         col_decoder->finalize();
 
-        cv::Mat res(rows, cols, CV_32S);
-        for(int r = 0; r < rows; r++) {
-            for(int c = 0; c < cols; c++) {
-                res.at<partition_key>(r, c) = df.find(make_key(r, c));
-            }
-        }
+        return mask_from_edges(edges);
 
-        return util::relabel(res);
+    }
 
+    virtual std::string config() const {
+        std::string row = row_codec_factory->config();
+        std::string col = col_codec_factory->config();
+        if(row.empty() || col.empty()) return "";
+        return "MulticutAwareCodec(" + row + "," + col + ")";
     }
 
     virtual std::unique_ptr<MulticutCodecBase> clone() const {
@@ -4,16 +4,22 @@
 #include "codec.h"
 #include "util.h"
 #include "arithmetic.h"
-#include "unionfind.h"
+#include "rans.h"
 
 using namespace util;
 
-cv::Mat mask_from_edges(std::vector<bool>& row_edges, std::vector<bool>& col_edges, size_t rows, size_t cols);
+// labels the partitions of the edges 0, 1, ... in the order of their first pixel (row-major),
+// n_partitions is set to the number of partitions if given
+cv::Mat mask_from_edges(const EdgeMap& edges, size_t* n_partitions = nullptr);
 
 struct DefaultMulticutCodec : public MulticutCodecBase {
-    virtual void write_encoding(BitStream& bs, const cv::Mat& mask);
+    virtual void write_edges(BitStream& bs, const EdgeMap& edges);
     virtual cv::Mat read_mask(BitStreamReader& reader, size_t rows, size_t cols);
     virtual std::unique_ptr<MulticutCodecBase> clone() const;
+
+    virtual std::string config() const {
+        return "DefaultMulticutCodec";
+    }
 };
 
 struct BlockToken {
@@ -78,121 +84,68 @@ namespace std {
 
 // idea: encode multicut by splitting the image pixels into 2x2 blocks. Each block contains 8 outgoing edges.
 // These 2^8 blocks can be encoded more efficiently using a huffman coding. For this, the frequency of each block is measured.
-// From these frequencies, a huffman coder is constructed (see huffman.h). To allow for reconstruction of the code, the 256 frequencies
-// are stored and transmitted together with the multicut. 
+// From these frequencies, a canonical huffman code is constructed (see huffman.h). To allow for reconstruction of the code, 
+// the 256 code lengths are stored and transmitted together with the multicut. 
 struct DynamicHuffmanCodec : MulticutCodecBase {
 
-    const unsigned FREQ_PRECISION = 10; // TODO: constructor or template?
+    const unsigned MAX_CODE_BITS = 15;
 
-    virtual void write_encoding(BitStream& bs, const cv::Mat& mask) {
+    virtual void write_edges(BitStream& bs, const EdgeMap& edges) {
 
-        std::vector<bool> row_edges;
-        for(size_t r = 0; r < mask.rows; r++) {
-            for(size_t c = 0; c < mask.cols - 1; c++) {
-                row_edges.push_back(mask.at<int32_t>(r, c) == mask.at<int32_t>(r, c+1));
-            }
-        }
+        int edges_per_row = edges.cols - 1;
+        int edges_per_col = edges.rows - 1;
 
-        std::vector<bool> col_edges;
-        for(size_t c = 0; c < mask.cols; c++) {
-            for(size_t r = 0; r < mask.rows - 1; r++) {
-                col_edges.push_back(mask.at<int32_t>(r, c) == mask.at<int32_t>(r+1, c));
-            }
-        }
-
-        auto get = [](std::vector<bool>& v, int i) -> bool {
-            if(i < v.size()) return v[i];
-            return false;
+        // the edges are addressed as in the DefaultMulticutCodec's stream: row edges row-major, col edges column-major.
+        // an index past the end of a row (column) continues in the next one, past the last edge it reads false.
+        auto get_row = [&](int i) -> bool {
+            if(edges_per_row <= 0 || i >= edges.rows * edges_per_row) return false;
+            return edges.horizontal(i / edges_per_row, i % edges_per_row);
         };
 
-        int edges_per_row = mask.cols - 1;
-        int edges_per_col = mask.rows - 1;
+        auto get_col = [&](int i) -> bool {
+            if(edges_per_col <= 0 || i >= edges.cols * edges_per_col) return false;
+            return edges.vertical(i % edges_per_col, i / edges_per_col);
+        };
 
         std::vector<BlockToken> tokens;
-        std::map<BlockToken, size_t> token_freq;
+        std::vector<uint64_t> token_freq(256, 0);
 
-        for(size_t r = 0; r < mask.rows; r+=2) {
-            for(size_t c = 0; c < mask.cols; c+=2) {
+        for(int r = 0; r < edges.rows; r+=2) {
+            for(int c = 0; c < edges.cols; c+=2) {
 
                 int row_edge_start = r * edges_per_row + c;
                 int col_edge_start = c * edges_per_col + r;
 
                 BlockToken token;
-                token.set(0, get(row_edges, row_edge_start));
-                token.set(1, get(row_edges, row_edge_start+1));
-                token.set(2, get(row_edges, row_edge_start+edges_per_row));
-                token.set(3, get(row_edges, row_edge_start+edges_per_row+1));
-                token.set(4, get(col_edges, col_edge_start));
-                token.set(5, get(col_edges, col_edge_start+1));
-                token.set(6, get(col_edges, col_edge_start+edges_per_col));
-                token.set(7, get(col_edges, col_edge_start+edges_per_col+1));
+                token.set(0, get_row(row_edge_start));
+                token.set(1, get_row(row_edge_start+1));
+                token.set(2, get_row(row_edge_start+edges_per_row));
+                token.set(3, get_row(row_edge_start+edges_per_row+1));
+                token.set(4, get_col(col_edge_start));
+                token.set(5, get_col(col_edge_start+1));
+                token.set(6, get_col(col_edge_start+edges_per_col));
+                token.set(7, get_col(col_edge_start+edges_per_col+1));
 
                 tokens.push_back(token);
-                token_freq[token]++;
+                token_freq[token.data]++;
             }
         }
 
-        // normalize token freqs
-        unsigned MAX_ENCODE = (1 << FREQ_PRECISION) - 1;
-        unsigned max_freq = 1;
-
-        std::vector<double> freqs;
-
-        for(auto& [token, freq] : token_freq) {
-            if(freq > max_freq) max_freq = freq;
-            freqs.push_back(freq);
-        }
-
-        // pprintln("theoretical entropy:", entropy(freqs));
-
-        for(auto& [token, freq] : token_freq) {
-            // ensure that nonzero frequencies are maintained (otherwise the codec will not recognize these tokens)
-            double prob = double(freq) / double(max_freq);
-            freq = std::clamp(unsigned(prob * MAX_ENCODE), unsigned(1), MAX_ENCODE);
-        }
-
-        // write frequencies to stream
-        for(int i = 0; i < 256; i++) {
-            BlockToken key;
-            key.data = uint8_t(i);
-            if(token_freq.find(key) != token_freq.end()) {
-                unsigned f = token_freq[key];
-                bs.append<unsigned>(f, FREQ_PRECISION);
-            }
-            else {
-                bs.append<unsigned>(0, FREQ_PRECISION);
-            }
+        // build the huffman code from the exact frequencies, only the code lengths need to be transmitted
+        auto codec = CanonicalHuffmanCodec::from_freqs(token_freq, MAX_CODE_BITS);
+        codec.write_lengths(bs);
+        BitWriter writer(bs);
+        for(const BlockToken& token : tokens) {
+            codec.write(writer, token.data);
         }
 
-        // build the huffman codec and encode all tokens to the stream
-        std::vector<std::pair<BlockToken, unsigned>> v_token_freqs(token_freq.begin(), token_freq.end());
-        HuffmanCodec<BlockToken> codec(v_token_freqs);
-        codec.encode_tokens(tokens, bs);
-
-
     }
 
     virtual cv::Mat read_mask(BitStreamReader& reader, size_t rows, size_t cols) {
         
-        std::vector<std::pair<BlockToken, unsigned>> v_token_freqs;
+        auto codec = CanonicalHuffmanCodec::read_lengths(reader, 256);
 
-        for(int i = 0; i < 256; i++) {
-            BlockToken key;
-            key.data = uint8_t(i);
-            
-            unsigned freq = reader.read<unsigned>(FREQ_PRECISION);
-            if(freq > 0) {
-                v_token_freqs.push_back(std::make_pair(key, freq));
-            }
-        }
-
-        HuffmanCodec<BlockToken> codec(v_token_freqs);
-
-        size_t n_row_edges = (cols - 1) * rows;
-        std::vector<bool> row_edges(n_row_edges);
-
-        size_t n_col_edges = cols * (rows - 1);
-        std::vector<bool> col_edges(n_col_edges);
+        EdgeMap edges(rows, cols);
 
         int blocks_per_row = (cols+1) / 2;
         int blocks_per_col = (rows+1) / 2;
@@ -200,12 +153,19 @@ struct DynamicHuffmanCodec : MulticutCodecBase {
         int edges_per_row = cols - 1;
         int edges_per_col = rows - 1;
 
-        auto set = [](std::vector<bool>& v, int i, bool val) -> void {
-            if(i < v.size()) v[i] = val;
+        // the same addressing as in write_edges
+        auto set_row = [&](int i, bool val) -> void {
+            if(edges_per_row > 0 && i < int(rows) * edges_per_row) edges.set_horizontal(i / edges_per_row, i % edges_per_row, val);
+        };
+
+        auto set_col = [&](int i, bool val) -> void {
+            if(edges_per_col > 0 && i < int(cols) * edges_per_col) edges.set_vertical(i % edges_per_col, i / edges_per_col, val);
         };
 
+        BitReader token_reader(reader);
         for(int i = 0; i < n_blocks; i++) {
-            BlockToken token = codec.read_next(reader);
+            BlockToken token;
+            token.data = codec.read(token_reader);
             int block_r = i / blocks_per_row;
             int block_c = i % blocks_per_row;
             int r = block_r * 2;
@@ -213,17 +173,21 @@ struct DynamicHuffmanCodec : MulticutCodecBase {
             int row_edge_start = r * edges_per_row + c;
             int col_edge_start = c * edges_per_col + r;
 
-            set(row_edges, row_edge_start,                  token.get(0));
-            set(row_edges, row_edge_start+1,                token.get(1));
-            set(row_edges, row_edge_start+edges_per_row,    token.get(2));
-            set(row_edges, row_edge_start+edges_per_row+1,  token.get(3));
-            set(col_edges, col_edge_start,                  token.get(4));
-            set(col_edges, col_edge_start+1,                token.get(5));
-            set(col_edges, col_edge_start+edges_per_col,    token.get(6));
-            set(col_edges, col_edge_start+edges_per_col+1,  token.get(7));
+            set_row(row_edge_start,                  token.get(0));
+            set_row(row_edge_start+1,                token.get(1));
+            set_row(row_edge_start+edges_per_row,    token.get(2));
+            set_row(row_edge_start+edges_per_row+1,  token.get(3));
+            set_col(col_edge_start,                  token.get(4));
+            set_col(col_edge_start+1,                token.get(5));
+            set_col(col_edge_start+edges_per_col,    token.get(6));
+            set_col(col_edge_start+edges_per_col+1,  token.get(7));
         }
 
-        return mask_from_edges(row_edges, col_edges, rows, cols);
+        return mask_from_edges(edges);
+    }
+
+    virtual std::string config() const {
+        return "DynamicHuffmanCodec";
     }
 
     virtual std::unique_ptr<MulticutCodecBase> clone() const {
@@ -281,7 +245,7 @@ namespace std {
 
 class BorderCodecSymbolTable {
 
-    std::unordered_map<unsigned, SimpleFrequencyTable> len2tab;
+    std::unordered_map<unsigned, RansFrequencyTable> len2tab;
     int freq_precision;
 
 public:
@@ -296,7 +260,7 @@ public:
                 uint32_t freq = reader.read<uint32_t>(freq_precision);
                 freqs.push_back(freq);
             }
-            len2tab.emplace(len, SimpleFrequencyTable(freqs));
+            len2tab.emplace(len, RansFrequencyTable(freqs));
         }
 
     }
@@ -327,7 +291,7 @@ public:
                 }
             }
 
-            len2tab.emplace(len, SimpleFrequencyTable(data2count)); 
+            len2tab.emplace(len, RansFrequencyTable(data2count));
         }
     }
 
@@ -341,13 +305,13 @@ public:
         }
     }
 
-    std::vector<bool> read_symbol(WrappedArithmeticDecoder& dec, int len) {
+    std::vector<bool> read_symbol(RansDecoder& dec, int len) {
         uint32_t data = dec.read(len2tab.at(len));
         BorderCodecSymbol sym(data, len);
         return sym.as_vec();
     }
 
-    void write_symbol(WrappedArithmeticEncoder& enc, const BorderCodecSymbol& sym) {
+    void write_symbol(RansEncoder& enc, const BorderCodecSymbol& sym) {
         enc.write(len2tab.at(sym.len), sym.data);
     }
 
@@ -355,7 +319,7 @@ public:
         std::cout << "--- BorderCodecSymbolTable ---" << std::endl;
         for(auto& [len, tab] : len2tab) {
             std::cout << "len = " << len << " | ";
-            for(int i = 0; i < tab.getSymbolLimit(); i++) {
+            for(int i = 0; i < tab.size(); i++) {
                 std::cout << tab.get(i) << " ";
             }
             std::cout << std::endl;
@@ -468,18 +432,19 @@ private:
 
     };
 
-    bool read_from_mask(const Edge& e, const cv::Mat& mask) {
+    // the border edges run between the pixels, a horizontal border edge separates the pixels above and below it
+    bool read_from_edges(const Edge& e, const EdgeMap& edges) {
         const Point& a = e.a;
         const Point& b = e.b;
         bool v;
 
         if(a.r == b.r) { // horizontal edge
             int col = std::min(a.c, b.c);
-            v = (mask.at<int32_t>(a.r-1, col) == mask.at<int32_t>(a.r, col)) == ENCODE_JOIN_EDGES;
+            v = edges.vertical(a.r-1, col) == ENCODE_JOIN_EDGES;
         }
         else if(a.c == b.c) { // vertical edge
             int row = std::min(a.r, b.r);
-            v = (mask.at<int32_t>(row, a.c-1) == mask.at<int32_t>(row, a.c)) == ENCODE_JOIN_EDGES;
+            v = edges.horizontal(row, a.c-1) == ENCODE_JOIN_EDGES;
         }
         else {
             std::cout << "WARNING: Unexpected edge received." << std::endl;
@@ -493,16 +458,16 @@ private:
 
 public:
 
-    virtual void write_encoding(BitStream& bs, const cv::Mat& mask) {
+    virtual void write_edges(BitStream& bs, const EdgeMap& edges) {
 
-        State s(mask.rows, mask.cols);
+        State s(edges.rows, edges.cols);
         std::vector<BorderCodecSymbol> syms;
 
         std::function<std::vector<bool>(std::vector<Edge>)> f = [&](std::vector<Edge> read_edges) {
             std::vector<bool> data;
 
             for(const Edge& e : read_edges) {
-                bool v = read_from_mask(e, mask);
+                bool v = read_from_edges(e, edges);
                 data.push_back(v);
             }
 
@@ -512,11 +477,11 @@ public:
 
 
         std::vector<Point> roots;
-        for(int r = 0; r <= mask.rows; r++) {
-            for(int c = 0; c <= mask.cols; c++) {
+        for(int r = 0; r <= edges.rows; r++) {
+            for(int c = 0; c <= edges.cols; c++) {
                 Point p(r, c);
                 auto adj = s.adjacent(p);
-                if(std::any_of(adj.begin(), adj.end(), [&](const Edge& e) { return read_from_mask(e, mask); })) {
+                if(std::any_of(adj.begin(), adj.end(), [&](const Edge& e) { return read_from_edges(e, edges); })) {
                     roots.push_back(p);
                     s.iterate(p, f);
                 }
@@ -532,7 +497,7 @@ public:
         BorderCodecSymbolTable tab(syms, 10);
         tab.encode(bs);
 
-        WrappedArithmeticEncoder enc;
+        RansEncoder enc;
         for(const auto& sym : syms) {
             tab.write_symbol(enc, sym);
         }
@@ -552,7 +517,7 @@ public:
         
         BorderCodecSymbolTable tab(reader);
 
-        WrappedArithmeticDecoder dec(reader);
+        RansDecoder dec(reader);
         State s(rows, cols);
 
         std::function<std::vector<bool>(std::vector<Edge>)> f = [&](std::vector<Edge> read_edges) {
@@ -563,44 +528,39 @@ public:
             s.iterate(r, f);
         }
 
-        auto make_key = [](int r, int c, int stride) {
-            return r * stride + c;
-        };
+        EdgeMap edges(rows, cols);
 
-        std::vector<bool> row_edges;
-        row_edges.reserve(rows * (cols-1));
-
-        std::vector<bool> col_edges;
-        col_edges.reserve((rows-1) * cols);
-
-        // append row edges
+        // the edges between pixels in a row
         for(size_t r = 0; r < rows; r++) {
             for(size_t c = 0; c < cols - 1; c++) {
                 Point a(r, c+1);
                 Point b(r+1, c+1);
                 Edge e(a, b);
                 if(s.known_edges.find(e) == s.known_edges.end()) 
-                    row_edges.push_back(!ENCODE_JOIN_EDGES);
+                    edges.set_horizontal(r, c, !ENCODE_JOIN_EDGES);
                 else 
-                    row_edges.push_back(s.known_edges.at(e) == ENCODE_JOIN_EDGES);
+                    edges.set_horizontal(r, c, s.known_edges.at(e) == ENCODE_JOIN_EDGES);
             }
         }
 
-        // append col edges
+        // the edges between pixels in a column
         for(size_t c = 0; c < cols; c++) {
             for(size_t r = 0; r < rows - 1; r++) {
                 Point a(r+1, c);
                 Point b(r+1, c+1);
                 Edge e(a, b);
                 if(s.known_edges.find(e) == s.known_edges.end()) 
-                    col_edges.push_back(!ENCODE_JOIN_EDGES);
+                    edges.set_vertical(r, c, !ENCODE_JOIN_EDGES);
                 else 
-                    col_edges.push_back(s.known_edges.at(e) == ENCODE_JOIN_EDGES);
+                    edges.set_vertical(r, c, s.known_edges.at(e) == ENCODE_JOIN_EDGES);
             }
         }
 
-        auto res = mask_from_edges(row_edges, col_edges, rows, cols);
-        return util::relabel(res);
+        return mask_from_edges(edges);
+    }
+
+    virtual std::string config() const {
+        return "BorderCodec(" + std::to_string(int(ENCODE_JOIN_EDGES)) + ")";
     }
 
     virtual std::unique_ptr<MulticutCodecBase> clone() const {
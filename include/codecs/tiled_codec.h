@@ -0,0 +1,486 @@
+#pragma once
+#include <memory>
+#include <numeric>
+#include <algorithm>
+#include <bit>
+
+#include "codec.h"
+#include "multicut_codec.h"
+#include "binary_range_coder.h"
+
+/*
+
+The TiledMulticutCodec splits the mask into a grid of tiles, which are encoded independently by
+clones of an inner multicut codec, each with its own coder state. Encoding and decoding of the
+tiles run in parallel.
+
+The inner codecs only see the edges inside their tile, they label the parts of the partitions inside
+a tile (the local components) separately. These are joined into the partitions of the mask in one of
+two ways:
+
+- By default, the edges crossing the seams between tiles are coded in a small boundary stream.
+  After the tiles are decoded, their components are joined along the seams and relabeled in
+  row-major order, as all multicut codecs require.
+
+- In indexed mode, the partitions are labeled in the order in which they are first met when
+  visiting the tiles in row-major order, and the pixels of every tile in row-major order (see relabel).
+  The components that start a new partition then get consecutive labels, so it suffices to store the
+  labels of the components continuing a partition of an earlier tile (or an earlier component of the
+  same tile) in a per-tile index. A tile can then be decoded on its own, which allows decoding a
+  region of the mask (see read_region) in time proportional to the tiles it intersects.
+
+Layout:
+    tile_rows (32 bits) | tile_cols (32 bits) | indexed (8 bits)
+    the size of each tile's stream in bits (32 bits each, the offset table)
+    indexed: the index of each tile (see TileIndex)
+    otherwise: the boundary stream (see BinaryRangeEncoder::finish)
+    the streams of the tiles, in row-major order of the tiles
+
+The tiles of a grid row (column) have equal height (width) up to one pixel, see TileGrid.
+
+*/
+
+// The split of a rows x cols mask into tiles of nominally tile_rows x tile_cols pixels.
+// The remainder is spread over the tiles instead of producing a small last tile.
+struct TileGrid {
+
+    std::vector<int> row_starts; // the first row of every grid row, followed by rows
+    std::vector<int> col_starts; // the first column of every grid column, followed by cols
+
+    TileGrid(int rows, int cols, int tile_rows, int tile_cols) {
+        row_starts = split(rows, tile_rows);
+        col_starts = split(cols, tile_cols);
+    }
+
+    size_t grid_rows() const {
+        return row_starts.size() - 1;
+    }
+
+    size_t grid_cols() const {
+        return col_starts.size() - 1;
+    }
+
+    size_t size() const {
+        return grid_rows() * grid_cols();
+    }
+
+    cv::Rect tile(size_t i) const {
+        size_t gr = i / grid_cols();
+        size_t gc = i % grid_cols();
+        return cv::Rect(
+            col_starts[gc], row_starts[gr],
+            col_starts[gc + 1] - col_starts[gc], row_starts[gr + 1] - row_starts[gr]
+        );
+    }
+
+private:
+
+    static std::vector<int> split(int n, int tile_size) {
+        int n_tiles = std::max(1, (n + tile_size - 1) / std::max(tile_size, 1));
+        std::vector<int> res(n_tiles + 1);
+        for(int i = 0; i <= n_tiles; i++) {
+            res[i] = int(int64_t(i) * n / n_tiles);
+        }
+        return res;
+    }
+
+};
+
+struct TiledMulticutCodec : public MulticutCodecBase {
+
+    std::unique_ptr<MulticutCodecBase> inner;
+    int tile_rows;
+    int tile_cols;
+    bool indexed;
+
+    // tile_cols = 0 splits the mask into horizontal stripes of full width
+    TiledMulticutCodec(std::unique_ptr<MulticutCodecBase> inner, int tile_rows = 256, int tile_cols = 0, bool indexed = false)
+        : inner(std::move(inner)), tile_rows(tile_rows), tile_cols(tile_cols), indexed(indexed) {
+
+    }
+
+    TiledMulticutCodec(const TiledMulticutCodec& other)
+        : TiledMulticutCodec(other.inner->clone(), other.tile_rows, other.tile_cols, other.indexed) {
+
+    }
+
+    virtual void write_encoding(BitStream& bs, const cv::Mat& mask) {
+        write(bs, EdgeMap(mask), indexed ? &mask : nullptr);
+    }
+
+    virtual void write_edges(BitStream& bs, const EdgeMap& edges) {
+        if(indexed) {
+            // the index is built from the labels
+            cv::Mat mask = mask_from_edges(edges);
+            write(bs, edges, &mask);
+        }
+        else {
+            write(bs, edges, nullptr);
+        }
+    }
+
+    virtual cv::Mat read_mask(BitStreamReader& reader, size_t rows, size_t cols) {
+        size_t n_partitions;
+        return read_region(reader, rows, cols, cv::Rect(0, 0, cols, rows), n_partitions);
+    }
+
+    virtual bool relabel(const cv::Mat& mask, cv::Mat& out) const {
+        if(!indexed) return false;
+        out = tile_major_labels(mask, make_grid(mask.rows, mask.cols));
+        return true;
+    }
+
+    virtual bool random_access() const {
+        return indexed;
+    }
+
+    // in indexed mode, only the tiles intersecting roi are decoded
+    virtual cv::Mat read_region(BitStreamReader& reader, size_t rows, size_t cols, const cv::Rect& roi, size_t& n_partitions) {
+        int t_rows = reader.read32u();
+        int t_cols = reader.read32u();
+        bool is_indexed = reader.read8u();
+        TileGrid grid(rows, cols, t_rows, t_cols);
+
+        std::vector<size_t> tile_bits(grid.size());
+        for(size_t& n : tile_bits) {
+            n = reader.read32u();
+        }
+
+        if(is_indexed) {
+            std::vector<TileIndex> index(grid.size());
+            {
+                BitReader index_reader(reader);
+                for(size_t i = 0; i < index.size(); i++) {
+                    if(i > 0) index[i].base = index[i - 1].base + index[i - 1].n_new;
+                    index[i].read(index_reader);
+                }
+            }
+            std::vector<BitStreamView> tile_views = read_tile_views(reader, tile_bits);
+            n_partitions = index.empty() ? 0 : index.back().base + index.back().n_new;
+            return read_indexed(grid, index, tile_views, roi);
+        }
+
+        BinaryRangeDecoder decoder(reader);
+        std::vector<BitStreamView> tile_views = read_tile_views(reader, tile_bits);
+        cv::Mat mask = read_joined(grid, tile_views, decoder, n_partitions);
+        if(roi == cv::Rect(0, 0, cols, rows)) return mask;
+        return mask(roi).clone();
+    }
+
+    virtual std::string config() const {
+        std::string inner_config = inner->config();
+        if(inner_config.empty()) return "";
+        return "TiledMulticutCodec(" + inner_config + "," + std::to_string(tile_rows) + "," + std::to_string(tile_cols) + ","
+            + std::to_string(int(indexed)) + ")";
+    }
+
+    virtual std::unique_ptr<MulticutCodecBase> clone() const {
+        return std::make_unique<TiledMulticutCodec>(*this);
+    }
+
+private:
+
+    TileGrid make_grid(int rows, int cols) const {
+        return TileGrid(rows, cols, tile_rows, tile_cols > 0 ? tile_cols : cols);
+    }
+
+    // mask is only needed in indexed mode
+    void write(BitStream& bs, const EdgeMap& edges, const cv::Mat* mask) const {
+        TileGrid grid = make_grid(edges.rows, edges.cols);
+
+        std::vector<BitStream> tile_streams(grid.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(size_t i = 0; i < grid.size(); i++) {
+            inner->clone()->write_edges(tile_streams[i], edges.crop(grid.tile(i)));
+        }
+
+        bs.append<uint32_t>(tile_rows, 32);
+        bs.append<uint32_t>(tile_cols > 0 ? tile_cols : edges.cols, 32);
+        bs.append<uint8_t>(indexed, 8);
+        for(const BitStream& tile_stream : tile_streams) {
+            bs.append<uint32_t>(tile_stream.size(), 32);
+        }
+
+        if(indexed) {
+            BitWriter writer(bs);
+            for(const TileIndex& index : build_index(tile_major_labels(*mask, grid), grid)) {
+                index.write(writer);
+            }
+        }
+        else {
+            BinaryRangeEncoder encoder;
+            SeamModel model;
+            for_each_seam(grid, [&](int r0, int c0, int r1, int c1) {
+                bool joined = r0 == r1 ? edges.horizontal(r0, c0) : edges.vertical(r0, c0);
+                model.code(joined, [&](bool bit, uint32_t p0) {
+                    encoder.encode(bit, p0);
+                    return bit;
+                });
+            });
+            encoder.finish(bs);
+        }
+
+        for(const BitStream& tile_stream : tile_streams) {
+            bs.append_stream(tile_stream);
+        }
+    }
+
+    // The labels of the components of a tile in indexed mode. The components starting a new partition are labeled
+    // base, base + 1, ... in their order, the labels of the other components are stored explicitly.
+    struct TileIndex {
+
+        int32_t base = 0; // the number of partitions met in the earlier tiles, not stored
+        int32_t n_components = 0;
+        int32_t n_new = 0;
+        std::vector<std::pair<int32_t, int32_t>> continued; // (component, label), ascending by component
+
+        // n_components | n_new | the number of continued components (32 bits each),
+        // followed by their (component, label) pairs with as many bits as the largest possible values need
+        void write(BitWriter& writer) const {
+            writer.write(n_components, 32);
+            writer.write(n_new, 32);
+            writer.write(continued.size(), 32);
+            uint32_t component_bits = std::bit_width(uint32_t(n_components));
+            uint32_t label_bits = std::bit_width(uint32_t(base + n_new));
+            for(auto [component, label] : continued) {
+                writer.write(component, component_bits);
+                writer.write(label, label_bits);
+            }
+        }
+
+        // base has to be set before
+        void read(BitReader& reader) {
+            n_components = reader.read(32);
+            n_new = reader.read(32);
+            continued.resize(reader.read(32));
+            uint32_t component_bits = std::bit_width(uint32_t(n_components));
+            uint32_t label_bits = std::bit_width(uint32_t(base + n_new));
+            for(auto& [component, label] : continued) {
+                component = reader.read(component_bits);
+                label = reader.read(label_bits);
+            }
+        }
+
+        // the label of every component
+        std::vector<int32_t> labels() const {
+            std::vector<int32_t> res(n_components);
+            int32_t next = base;
+            auto it = continued.begin();
+            for(int32_t k = 0; k < n_components; k++) {
+                if(it != continued.end() && it->first == k) {
+                    res[k] = (it++)->second;
+                }
+                else {
+                    res[k] = next++;
+                }
+            }
+            return res;
+        }
+
+    };
+
+    // relabels the partitions of mask in the order in which they are met, visiting the tiles in row-major order
+    // and the pixels of each tile in row-major order
+    static cv::Mat tile_major_labels(const cv::Mat& mask, const TileGrid& grid) {
+        int32_t max_label = 0;
+        for(int r = 0; r < mask.rows; r++) {
+            const int32_t* row = mask.ptr<int32_t>(r);
+            max_label = std::max(max_label, *std::max_element(row, row + mask.cols));
+        }
+
+        std::vector<int32_t> new_label(size_t(max_label) + 1, -1);
+        int32_t next_label = 0;
+        cv::Mat res(mask.rows, mask.cols, CV_32SC1);
+        for(size_t i = 0; i < grid.size(); i++) {
+            cv::Rect rect = grid.tile(i);
+            for(int r = rect.y; r < rect.y + rect.height; r++) {
+                const int32_t* src = mask.ptr<int32_t>(r);
+                int32_t* dst = res.ptr<int32_t>(r);
+                for(int c = rect.x; c < rect.x + rect.width; c++) {
+                    int32_t& label = new_label[src[c]];
+                    if(label < 0) label = next_label++;
+                    dst[c] = label;
+                }
+            }
+        }
+        return res;
+    }
+
+    // the label of the first pixel of every connected component of equal labels inside rect,
+    // with the components in row-major order of their first pixels (the order of the inner codec's labels)
+    static std::vector<int32_t> component_labels(const cv::Mat& mask, const cv::Rect& rect) {
+        std::vector<int32_t> parents(size_t(rect.width) * rect.height);
+        auto find = [&](int32_t x) {
+            while(parents[x] != x) {
+                parents[x] = parents[parents[x]];
+                x = parents[x];
+            }
+            return x;
+        };
+
+        for(int r = 0; r < rect.height; r++) {
+            const int32_t* row = mask.ptr<int32_t>(rect.y + r) + rect.x;
+            const int32_t* above = r > 0 ? mask.ptr<int32_t>(rect.y + r - 1) + rect.x : nullptr;
+            for(int c = 0; c < rect.width; c++) {
+                int32_t p = r * rect.width + c;
+                parents[p] = p;
+                if(c > 0 && row[c - 1] == row[c]) {
+                    parents[p] = find(p - 1);
+                }
+                if(above && above[c] == row[c]) {
+                    int32_t a = find(p - rect.width);
+                    int32_t b = find(p);
+                    parents[std::max(a, b)] = std::min(a, b);
+                }
+            }
+        }
+
+        // the roots are the first pixels of their components
+        std::vector<int32_t> res;
+        for(int32_t p = 0; p < int32_t(parents.size()); p++) {
+            if(find(p) == p) {
+                res.push_back(mask.at<int32_t>(rect.y + p / rect.width, rect.x + p % rect.width));
+            }
+        }
+        return res;
+    }
+
+    // the index of every tile for a mask in tile-major order (see tile_major_labels)
+    static std::vector<TileIndex> build_index(const cv::Mat& mask, const TileGrid& grid) {
+        std::vector<std::vector<int32_t>> components(grid.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(size_t i = 0; i < grid.size(); i++) {
+            components[i] = component_labels(mask, grid.tile(i));
+        }
+
+        // as the labels are given in the order the partitions are met, a component starts
+        // a new partition if and only if its label is the next one
+        std::vector<TileIndex> res(grid.size());
+        int32_t next = 0;
+        for(size_t i = 0; i < grid.size(); i++) {
+            TileIndex& index = res[i];
+            index.base = next;
+            index.n_components = components[i].size();
+            for(int32_t k = 0; k < index.n_components; k++) {
+                int32_t label = components[i][k];
+                if(label == next) next++;
+                else index.continued.emplace_back(k, label);
+            }
+            index.n_new = next - index.base;
+        }
+        return res;
+    }
+
+    static std::vector<BitStreamView> read_tile_views(BitStreamReader& reader, const std::vector<size_t>& tile_bits) {
+        std::vector<BitStreamView> res;
+        for(size_t n : tile_bits) {
+            res.push_back(reader.read_view(n));
+        }
+        return res;
+    }
+
+    // decodes the tiles intersecting roi and maps their components to the partitions with the index
+    cv::Mat read_indexed(const TileGrid& grid, const std::vector<TileIndex>& index, const std::vector<BitStreamView>& tile_views, const cv::Rect& roi) {
+        std::vector<size_t> tiles;
+        for(size_t i = 0; i < grid.size(); i++) {
+            if((grid.tile(i) & roi).area() > 0) tiles.push_back(i);
+        }
+
+        cv::Mat res(roi.height, roi.width, CV_32SC1);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(size_t j = 0; j < tiles.size(); j++) {
+            size_t i = tiles[j];
+            cv::Rect rect = grid.tile(i);
+            BitStreamReader tile_reader(tile_views[i]);
+            cv::Mat tile_mask = inner->clone()->read_mask(tile_reader, rect.height, rect.width);
+            std::vector<int32_t> labels = index[i].labels();
+
+            cv::Rect overlap = rect & roi;
+            for(int r = overlap.y; r < overlap.y + overlap.height; r++) {
+                const int32_t* src = tile_mask.ptr<int32_t>(r - rect.y) + (overlap.x - rect.x);
+                int32_t* dst = res.ptr<int32_t>(r - roi.y) + (overlap.x - roi.x);
+                for(int c = 0; c < overlap.width; c++) {
+                    dst[c] = labels[src[c]];
+                }
+            }
+        }
+        return res;
+    }
+
+    // decodes all tiles and joins their components along the seams
+    cv::Mat read_joined(const TileGrid& grid, const std::vector<BitStreamView>& tile_views, BinaryRangeDecoder& decoder, size_t& n_partitions) {
+        std::vector<EdgeMap> tile_edges(grid.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(size_t i = 0; i < grid.size(); i++) {
+            cv::Rect rect = grid.tile(i);
+            BitStreamReader tile_reader(tile_views[i]);
+            tile_edges[i] = EdgeMap(inner->clone()->read_mask(tile_reader, rect.height, rect.width));
+        }
+
+        // the tiles of a grid row share the words of the packed rows
+        EdgeMap edges(grid.row_starts.back(), grid.col_starts.back());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(size_t gr = 0; gr < grid.grid_rows(); gr++) {
+            for(size_t gc = 0; gc < grid.grid_cols(); gc++) {
+                size_t i = gr * grid.grid_cols() + gc;
+                edges.paste(tile_edges[i], grid.row_starts[gr], grid.col_starts[gc]);
+            }
+        }
+
+        SeamModel model;
+        for_each_seam(grid, [&](int r0, int c0, int r1, int c1) {
+            bool joined = model.code(false, [&](bool, uint32_t p0) {
+                return decoder.decode(p0);
+            });
+            if(r0 == r1) edges.set_horizontal(r0, c0, joined);
+            else edges.set_vertical(r0, c0, joined);
+        });
+
+        return mask_from_edges(edges, &n_partitions);
+    }
+
+    // the seam edges are mostly joins and come in runs along the seam,
+    // so they are coded adaptively with the previous edge of the seam as context
+    struct SeamModel {
+
+        uint32_t counts[2][2] = {{1, 1}, {1, 1}};
+        bool prev = true;
+
+        // code(bit, p0) codes the bit with the probability p0 of a 0 and returns it
+        template<typename Code>
+        bool code(bool bit, Code&& code) {
+            uint32_t* c = counts[prev];
+            bit = code(bit, binary_range_coder::prob_from_counts(c[0], c[1]));
+            c[bit]++;
+            if(c[0] + c[1] > 1024) {
+                c[0] = (c[0] + 1) / 2;
+                c[1] = (c[1] + 1) / 2;
+            }
+            prev = bit;
+            return bit;
+        }
+
+    };
+
+    // calls f(r0, c0, r1, c1) for every pair of adjacent pixels on different sides of a seam:
+    // first along the horizontal seams, then along the vertical seams of every grid row
+    template<typename F>
+    static void for_each_seam(const TileGrid& grid, F&& f) {
+        int cols = grid.col_starts.back();
+        for(size_t gr = 1; gr < grid.grid_rows(); gr++) {
+            int r = grid.row_starts[gr];
+            for(int c = 0; c < cols; c++) {
+                f(r - 1, c, r, c);
+            }
+        }
+        for(size_t gr = 0; gr < grid.grid_rows(); gr++) {
+            for(size_t gc = 1; gc < grid.grid_cols(); gc++) {
+                int c = grid.col_starts[gc];
+                for(int r = grid.row_starts[gr]; r < grid.row_starts[gr + 1]; r++) {
+                    f(r, c - 1, r, c);
+                }
+            }
+        }
+    }
+
+};
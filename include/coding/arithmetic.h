@@ -1,5 +1,6 @@
 #pragma once
 #include "bitstream.h"
+#include "rans.h"
 
 #include "BitIoStream.hpp"
 #include "FrequencyTable.hpp"
@@ -88,7 +89,6 @@ public:
 
 class WrappedArithmeticDecoder {
 
-    BitStream data;
     BitStreamReader data_reader;
 
     BitInputStreamAdapter adapter;
@@ -109,10 +109,10 @@ public:
 
 private:
     
+    // the coded data is read in place
     BitStreamReader init_reader(BitStreamReader& reader) {
         uint32_t n_bits = reader.read32u();
-        data = reader.read_substream(n_bits);
-        return BitStreamReader(data);
+        return BitStreamReader(reader.read_view(n_bits));
     }
 
 };
@@ -143,8 +143,9 @@ void encode_sequence(std::vector<int> data, BitStream& bs, uint32_t token_freq_b
 
     bs.append<uint32_t>(data.size(), 32);
 
-    WrappedArithmeticEncoder encoder;
-    auto ftable = SimpleFrequencyTable(token_freqs);
+    // the tables are static, so the sequence is coded with rANS (see rans.h)
+    RansEncoder encoder;
+    RansFrequencyTable ftable(token_freqs);
     for(int i : data) {
         encoder.write(ftable, i - vmin);
     }
@@ -161,14 +162,16 @@ std::vector<int> decode_sequence(BitStreamReader& reader, uint32_t token_freq_bi
     }
 
     uint32_t ntokens = reader.read32u();
-    std::vector<int> res;
-    res.reserve(ntokens);
 
-    auto ftable = SimpleFrequencyTable(token_freqs);
-    WrappedArithmeticDecoder decoder(reader);
+    RansFrequencyTable ftable(token_freqs);
+    RansDecoder decoder(reader);
 
-    for(int i = 0; i < ntokens; i++) {
-        res.push_back(decoder.read(ftable) + vmin);
+    std::vector<uint32_t> tokens(ntokens);
+    decoder.read(ftable, ntokens, tokens.data());
+
+    std::vector<int> res(ntokens);
+    for(size_t i = 0; i < ntokens; i++) {
+        res[i] = int(tokens[i]) + vmin;
     }
 
     return res;
@@ -0,0 +1,124 @@
+#pragma once
+#include "bitstream.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+// A binary range coder in the style of LZMA's, specialized for coding single bits with a given probability.
+// Compared to the general arithmetic coder (see arithmetic.h), no frequency tables are involved, the coding
+// interval is updated with one multiplication and output is produced a byte at a time.
+// Probabilities are given as the probability of a 0 bit, scaled to PROB_BITS bits.
+namespace binary_range_coder {
+
+    constexpr uint32_t PROB_BITS = 15;
+    constexpr uint32_t PROB_ONE = 1u << PROB_BITS;
+    constexpr uint32_t TOP = 1u << 24; // the range is kept above this by renormalization
+
+    // the probability of a 0 bit, given the number of 0 and 1 bits seen, clamped so that both bits stay codable
+    inline uint32_t prob_from_counts(uint32_t count_0, uint32_t count_1) {
+        uint32_t p = uint32_t((uint64_t(count_0) << PROB_BITS) / (uint64_t(count_0) + count_1));
+        return std::clamp<uint32_t>(p, 1, PROB_ONE - 1);
+    }
+
+}
+
+class BinaryRangeEncoder {
+
+    uint64_t low = 0;
+    uint32_t range = 0xFFFFFFFF;
+    uint8_t cache = 0;
+    uint64_t cache_size = 1; // the cached byte plus the number of pending 0xFF bytes
+    std::vector<uint8_t> bytes;
+
+public:
+
+    // p0 is the probability of bit == 0 in (0, PROB_ONE)
+    void encode(bool bit, uint32_t p0) {
+        using namespace binary_range_coder;
+        uint32_t bound = (range >> PROB_BITS) * p0;
+        uint32_t mask = -uint32_t(bit);
+        low += bound & mask;
+        range = (bound & ~mask) | ((range - bound) & mask);
+        while(range < TOP) {
+            range <<= 8;
+            shift_low();
+        }
+    }
+
+    // flushes the coder and appends the number of bytes (32 bits) followed by the bytes to bs
+    void finish(BitStream& bs) {
+        for(int i = 0; i < 5; i++) {
+            shift_low();
+        }
+        bs.append<uint32_t>(bytes.size(), 32);
+        BitWriter(bs).write_bytes(bytes.data(), bytes.size());
+    }
+
+private:
+
+    // emits the top byte of low, carries are propagated through the pending 0xFF bytes
+    void shift_low() {
+        if(uint32_t(low) < 0xFF000000u || (low >> 32) != 0) {
+            uint8_t carry = low >> 32;
+            uint8_t out = cache;
+            do {
+                bytes.push_back(out + carry);
+                out = 0xFF;
+            } while(--cache_size != 0);
+            cache = uint8_t(low >> 24);
+        }
+        cache_size++;
+        low = (low & 0x00FFFFFF) << 8;
+    }
+
+};
+
+class BinaryRangeDecoder {
+
+    std::vector<uint8_t> bytes;
+    size_t pos = 0;
+    uint32_t range = 0xFFFFFFFF;
+    uint32_t code = 0;
+
+public:
+
+    BinaryRangeDecoder() = default;
+
+    // reads the data written by BinaryRangeEncoder::finish
+    explicit BinaryRangeDecoder(BitStreamReader& reader) {
+        uint32_t n_bytes = reader.read32u();
+        bytes.resize(n_bytes);
+        BitReader(reader).read_bytes(bytes.data(), n_bytes);
+        if(n_bytes < 5) {
+            throw std::runtime_error("BinaryRangeDecoder: truncated stream");
+        }
+        for(int i = 0; i < 5; i++) {
+            code = (code << 8) | next_byte();
+        }
+    }
+
+    // p0 has to be the same probability that was passed to BinaryRangeEncoder::encode
+    bool decode(uint32_t p0) {
+        using namespace binary_range_coder;
+        uint32_t bound = (range >> PROB_BITS) * p0;
+        bool bit = code >= bound;
+        uint32_t mask = -uint32_t(bit);
+        code -= bound & mask;
+        range = (bound & ~mask) | ((range - bound) & mask);
+        while(range < TOP) {
+            range <<= 8;
+            code = (code << 8) | next_byte();
+        }
+        return bit;
+    }
+
+private:
+
+    // reading past the end yields zeros, like the flushed bytes of the encoder would
+    uint8_t next_byte() {
+        return pos < bytes.size() ? bytes[pos++] : 0;
+    }
+
+};
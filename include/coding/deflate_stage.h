@@ -0,0 +1,140 @@
+#pragma once
+#include "bitstream.h"
+
+#include <zlib.h>
+
+#include <array>
+#include <cassert>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+// A streaming zlib stage for the post-compression of encoded images (see CompressedMulticutImage).
+// The bytes are moved between the bitstreams and zlib through a fixed size buffer, so neither side is
+// copied into an intermediate byte vector. Every level produces a regular zlib stream, STORE uses zlib's
+// stored blocks, which only add a few bytes of framing, so the decoder does not need to know the level.
+namespace deflate_stage {
+
+    enum Level {
+        STORE, // no compression
+        FAST, // Z_BEST_SPEED
+        DEFAULT, // Z_DEFAULT_COMPRESSION, the level used before the stage was configurable
+        MAX, // Z_BEST_COMPRESSION
+        AUTO // chosen by estimate_level
+    };
+
+    constexpr size_t CHUNK_SIZE = 1 << 16;
+
+    // the size of the sample used by AUTO, and the fraction of DEFAULT's size MAX has to reach on it to be chosen
+    constexpr size_t SAMPLE_SIZE = 1 << 13;
+    constexpr double MAX_LEVEL_RATIO = 0.98;
+
+    inline int zlib_level(Level level) {
+        switch(level) {
+            case STORE: return Z_NO_COMPRESSION;
+            case FAST: return Z_BEST_SPEED;
+            case DEFAULT: return Z_DEFAULT_COMPRESSION;
+            default: return Z_BEST_COMPRESSION;
+        }
+    }
+
+    // picks the level for the bytes of in by deflating a sample of the first few KB with DEFAULT and MAX.
+    // on entropy coded data MAX is rarely much smaller than DEFAULT and sometimes larger.
+    inline Level estimate_level(BitStreamView in) {
+        std::array<uint8_t, SAMPLE_SIZE> sample;
+        size_t n_sample = std::min(in.size() / 8, SAMPLE_SIZE);
+        BitReader(in).read_bytes(sample.data(), n_sample);
+
+        std::array<uint8_t, SAMPLE_SIZE + SAMPLE_SIZE / 8 + 64> out;
+        uLongf size[2] = {0, 0};
+        Level levels[2] = {DEFAULT, MAX};
+        for(int i = 0; i < 2; i++) {
+            size[i] = out.size();
+            if(compress2(out.data(), &size[i], sample.data(), n_sample, zlib_level(levels[i])) != Z_OK) {
+                return MAX;
+            }
+        }
+
+        // the data is left as is if deflating does not shrink the sample at all
+        size_t best = size[1] < MAX_LEVEL_RATIO * size[0];
+        if(size[best] >= n_sample) return STORE;
+        return levels[best];
+    }
+
+    // deflates the bytes of in (its size has to be a multiple of 8) and appends the zlib stream to out
+    inline void compress(BitStreamView in, BitWriter& out, Level level = AUTO) {
+        assert(in.size() % 8 == 0);
+        if(level == AUTO) {
+            level = estimate_level(in);
+        }
+
+        BitReader reader(in);
+        size_t n_bytes = in.size() / 8;
+
+        z_stream zs = {};
+        if(deflateInit(&zs, zlib_level(level)) != Z_OK) {
+            throw std::runtime_error("deflate_stage: unable to initialize zlib");
+        }
+
+        std::array<uint8_t, CHUNK_SIZE> in_buf, out_buf;
+        int flush = Z_NO_FLUSH;
+        while(flush != Z_FINISH) {
+            size_t n = std::min(n_bytes, CHUNK_SIZE);
+            reader.read_bytes(in_buf.data(), n);
+            n_bytes -= n;
+            flush = n_bytes == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+            zs.next_in = in_buf.data();
+            zs.avail_in = uInt(n);
+            do {
+                zs.next_out = out_buf.data();
+                zs.avail_out = uInt(out_buf.size());
+                deflate(&zs, flush);
+                out.write_bytes(out_buf.data(), out_buf.size() - zs.avail_out);
+            } while(zs.avail_out == 0);
+        }
+        deflateEnd(&zs);
+    }
+
+    // inflates the zlib stream in the bytes of in and appends the result to out, returns the number of bytes appended
+    inline size_t decompress(BitStreamView in, BitWriter& out) {
+        BitReader reader(in);
+        size_t n_bytes = in.size() / 8;
+
+        z_stream zs = {};
+        if(inflateInit(&zs) != Z_OK) {
+            throw std::runtime_error("deflate_stage: unable to initialize zlib");
+        }
+
+        std::array<uint8_t, CHUNK_SIZE> in_buf, out_buf;
+        size_t n_out = 0;
+        int status = Z_OK;
+        while(status != Z_STREAM_END && n_bytes > 0) {
+            size_t n = std::min(n_bytes, CHUNK_SIZE);
+            reader.read_bytes(in_buf.data(), n);
+            n_bytes -= n;
+
+            zs.next_in = in_buf.data();
+            zs.avail_in = uInt(n);
+            do {
+                zs.next_out = out_buf.data();
+                zs.avail_out = uInt(out_buf.size());
+                status = inflate(&zs, Z_NO_FLUSH);
+                if(status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                    inflateEnd(&zs);
+                    throw std::runtime_error("deflate_stage: corrupt stream");
+                }
+                size_t produced = out_buf.size() - zs.avail_out;
+                out.write_bytes(out_buf.data(), produced);
+                n_out += produced;
+            } while(zs.avail_out == 0 && status != Z_STREAM_END);
+        }
+        inflateEnd(&zs);
+
+        if(status != Z_STREAM_END) {
+            throw std::runtime_error("deflate_stage: truncated stream");
+        }
+        return n_out;
+    }
+
+}
@@ -9,6 +9,10 @@
 #include <queue>
 #include <functional>
 #include <utility>
+#include <vector>
+#include <numeric>
+#include <cassert>
+#include <stdexcept>
 
 #include "bitstream.h"
 
@@ -240,6 +244,248 @@ public:
 
 
 
+// A canonical Huffman code over the symbols 0 ... n-1, with code lengths limited to max_code_bits.
+// The code is fully determined by the code lengths, so only these have to be transmitted (see write_lengths).
+// Encoding looks up the code of a symbol in a flat array. Decoding peeks PRIMARY_BITS bits and looks them up in
+// a table, codes longer than that continue in a secondary table for their prefix.
+class CanonicalHuffmanCodec {
+
+public:
+
+    static constexpr uint32_t PRIMARY_BITS = 11;
+    static constexpr uint32_t MAX_CODE_BITS = 16;
+
+private:
+
+    struct TableEntry {
+        uint16_t value; // the symbol, or the offset of the secondary table if sub_bits > 0
+        uint8_t length; // 0 marks a bit pattern that no code starts with
+        uint8_t sub_bits;
+    };
+
+    std::vector<uint8_t> lengths;
+    std::vector<uint32_t> codes;
+    uint32_t max_length = 0;
+
+    std::vector<TableEntry> primary;
+    std::vector<TableEntry> secondary;
+
+public:
+
+    CanonicalHuffmanCodec() = default;
+
+    // lengths[s] is the code length of symbol s, 0 if it does not occur
+    explicit CanonicalHuffmanCodec(const std::vector<uint8_t>& lengths) : lengths(lengths) {
+        assign_codes();
+        build_tables();
+    }
+
+    static CanonicalHuffmanCodec from_freqs(const std::vector<uint64_t>& freqs, uint32_t max_code_bits = 15) {
+        return CanonicalHuffmanCodec(code_lengths(freqs, max_code_bits));
+    }
+
+    size_t size() const {
+        return lengths.size();
+    }
+
+    uint32_t code_length(uint32_t symbol) const {
+        return lengths[symbol];
+    }
+
+    void write(BitWriter& writer, uint32_t symbol) const {
+        assert(lengths[symbol] > 0);
+        writer.write(codes[symbol], lengths[symbol]);
+    }
+
+    uint32_t read(BitReader& reader) const {
+        uint32_t window = reader.peek(PRIMARY_BITS);
+        TableEntry e = primary[window];
+        if(e.sub_bits > 0) {
+            window = reader.peek(PRIMARY_BITS + e.sub_bits);
+            e = secondary[e.value + (window & ((1u << e.sub_bits) - 1))];
+        }
+        if(e.length == 0) {
+            throw std::runtime_error("CanonicalHuffmanCodec: invalid code");
+        }
+        reader.consume(e.length);
+        return e.value;
+    }
+
+    // the lengths are coded per symbol as 0 (unused), 10 (same length as the previous used symbol)
+    // or 11 followed by the length - 1 in 4 bits
+    void write_lengths(BitStream& bs) const {
+        uint32_t last = 0;
+        for(uint8_t len : lengths) {
+            if(len == 0) {
+                bs.append<uint8_t>(0b0, 1);
+            }
+            else if(len == last) {
+                bs.append<uint8_t>(0b10, 2);
+            }
+            else {
+                bs.append<uint8_t>(0b11, 2);
+                bs.append<uint8_t>(len - 1, 4);
+                last = len;
+            }
+        }
+    }
+
+    static CanonicalHuffmanCodec read_lengths(BitStreamReader& reader, size_t n_symbols) {
+        std::vector<uint8_t> lengths(n_symbols, 0);
+        uint8_t last = 0;
+        for(uint8_t& len : lengths) {
+            if(!reader.read_bit()) continue;
+            if(reader.read_bit()) last = reader.read8u(4) + 1;
+            len = last;
+        }
+        return CanonicalHuffmanCodec(lengths);
+    }
+
+    // Huffman code lengths for the given frequencies. If the longest code exceeds max_code_bits, the long codes 
+    // are clamped and the Kraft sum is restored by lengthening the longest codes below the limit, after which
+    // any slack is spent on shortening the most frequent symbols.
+    static std::vector<uint8_t> code_lengths(const std::vector<uint64_t>& freqs, uint32_t max_code_bits) {
+        if(max_code_bits == 0 || max_code_bits > MAX_CODE_BITS) {
+            throw std::invalid_argument("CanonicalHuffmanCodec: unsupported code length limit");
+        }
+
+        std::vector<uint8_t> lengths(freqs.size(), 0);
+        std::vector<uint32_t> used;
+        for(uint32_t s = 0; s < freqs.size(); s++) {
+            if(freqs[s] > 0) used.push_back(s);
+        }
+        if(used.size() > (size_t(1) << max_code_bits)) {
+            throw std::invalid_argument("CanonicalHuffmanCodec: too many symbols for the code length limit");
+        }
+        if(used.size() == 1) lengths[used[0]] = 1;
+        if(used.size() <= 1) return lengths;
+
+        // nodes 0 ... used.size()-1 are the leaves, the merged nodes are appended, the root comes last
+        std::vector<uint64_t> weight;
+        std::vector<int32_t> parent(2 * used.size() - 1, -1);
+        for(uint32_t s : used) weight.push_back(freqs[s]);
+
+        using Item = std::pair<uint64_t, int32_t>;
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> pq;
+        for(int32_t i = 0; i < used.size(); i++) pq.emplace(weight[i], i);
+
+        while(pq.size() > 1) {
+            auto [wa, a] = pq.top(); pq.pop();
+            auto [wb, b] = pq.top(); pq.pop();
+            int32_t n = weight.size();
+            weight.push_back(wa + wb);
+            parent[a] = parent[b] = n;
+            pq.emplace(wa + wb, n);
+        }
+
+        // a parent always comes after its children
+        std::vector<uint32_t> depth(weight.size(), 0);
+        for(int32_t i = weight.size() - 2; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+        }
+
+        // the symbols from the least to the most frequent
+        std::vector<uint32_t> order(used.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return weight[a] < weight[b]; });
+
+        // the kraft sum in units of 2^-max_code_bits
+        const uint64_t one = uint64_t(1) << max_code_bits;
+        uint64_t kraft = 0;
+        for(uint32_t i = 0; i < used.size(); i++) {
+            depth[i] = std::min(depth[i], max_code_bits);
+            kraft += one >> depth[i];
+        }
+
+        while(kraft > one) {
+            uint32_t best = used.size();
+            for(uint32_t i : order) {
+                if(depth[i] < max_code_bits && (best == used.size() || depth[i] > depth[best])) best = i;
+            }
+            kraft -= one >> (depth[best] + 1);
+            depth[best]++;
+        }
+
+        for(auto it = order.rbegin(); it != order.rend(); it++) {
+            while(depth[*it] > 1 && kraft + (one >> depth[*it]) <= one) {
+                kraft += one >> depth[*it];
+                depth[*it]--;
+            }
+        }
+
+        for(uint32_t i = 0; i < used.size(); i++) {
+            lengths[used[i]] = depth[i];
+        }
+        return lengths;
+    }
+
+private:
+
+    // codes of the same length are consecutive integers in symbol order, shorter codes come first
+    void assign_codes() {
+        codes.assign(lengths.size(), 0);
+        max_length = 0;
+        for(uint8_t len : lengths) {
+            if(len > MAX_CODE_BITS) throw std::invalid_argument("CanonicalHuffmanCodec: code too long");
+            max_length = std::max<uint32_t>(max_length, len);
+        }
+
+        std::vector<uint32_t> count(max_length + 1, 0);
+        for(uint8_t len : lengths) count[len]++;
+        count[0] = 0;
+
+        std::vector<uint32_t> next_code(max_length + 1, 0);
+        uint32_t code = 0;
+        for(uint32_t len = 1; len <= max_length; len++) {
+            code = (code + count[len - 1]) << 1;
+            next_code[len] = code;
+        }
+
+        for(uint32_t s = 0; s < lengths.size(); s++) {
+            if(lengths[s] == 0) continue;
+            codes[s] = next_code[lengths[s]]++;
+            if(codes[s] >> lengths[s]) throw std::invalid_argument("CanonicalHuffmanCodec: lengths violate the kraft inequality");
+        }
+    }
+
+    void build_tables() {
+        primary.assign(size_t(1) << PRIMARY_BITS, TableEntry{0, 0, 0});
+        secondary.clear();
+
+        // the secondary table of a prefix has to hold the longest code starting with it
+        for(uint32_t s = 0; s < lengths.size(); s++) {
+            uint32_t len = lengths[s];
+            if(len <= PRIMARY_BITS) continue;
+            TableEntry& e = primary[codes[s] >> (len - PRIMARY_BITS)];
+            e.sub_bits = std::max<uint8_t>(e.sub_bits, len - PRIMARY_BITS);
+        }
+        for(TableEntry& e : primary) {
+            if(e.sub_bits == 0) continue;
+            e.value = secondary.size();
+            secondary.resize(secondary.size() + (size_t(1) << e.sub_bits), TableEntry{0, 0, 0});
+        }
+
+        for(uint32_t s = 0; s < lengths.size(); s++) {
+            uint32_t len = lengths[s];
+            if(len == 0) continue;
+
+            if(len <= PRIMARY_BITS) {
+                uint32_t first = codes[s] << (PRIMARY_BITS - len);
+                std::fill_n(primary.begin() + first, size_t(1) << (PRIMARY_BITS - len), TableEntry{uint16_t(s), uint8_t(len), 0});
+            }
+            else {
+                const TableEntry& p = primary[codes[s] >> (len - PRIMARY_BITS)];
+                uint32_t rest_bits = len - PRIMARY_BITS;
+                uint32_t rest = codes[s] & ((1u << rest_bits) - 1);
+                uint32_t first = p.value + (rest << (p.sub_bits - rest_bits));
+                std::fill_n(secondary.begin() + first, size_t(1) << (p.sub_bits - rest_bits), TableEntry{uint16_t(s), uint8_t(len), 0});
+            }
+        }
+    }
+
+};
+
+
 // encode sequence of integers using MPEG like rle+huffman scheme
 template<int zero_bits, int data_bits>
 void encode_runlength_huffman(
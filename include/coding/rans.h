@@ -0,0 +1,327 @@
+#pragma once
+#include "bitstream.h"
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+// A static-table rANS coder (range asymmetric numeral systems, see Duda 2013 and ryg_rans) for the paths that
+// code whole sequences against fixed frequency tables. Compared to the general arithmetic coder (see arithmetic.h),
+// a symbol is decoded with one table lookup, one multiplication and byte-wise renormalization.
+// The symbols are spread round robin over LANES interleaved coder states, so that the decoding
+// dependency chains of consecutive symbols overlap.
+namespace rans {
+
+    constexpr uint32_t LOWER_BOUND = 1u << 23; // states are kept in [LOWER_BOUND, 2^31)
+    constexpr size_t LANES = 4;
+
+    constexpr uint32_t MIN_SCALE_BITS = 12;
+    constexpr uint32_t MAX_SCALE_BITS = 15;
+    // only used if there are more than 2^MAX_SCALE_BITS symbols. larger scales would break the bound of
+    // two renormalization bytes per symbol and the 16 bit entries of the tables.
+    constexpr uint32_t LIMIT_SCALE_BITS = 16;
+
+}
+
+// Normalizes a set of (already quantized) counts to a total of 2^scale_bits and precomputes the tables used by
+// RansEncoder (a reciprocal per symbol, so that no division is needed) and RansDecoder (a lookup from
+// every slot of the total to its symbol). The normalization only depends on the counts, so the tables can be
+// rebuilt from the counts that are transmitted in the bitstream. Every symbol with a nonzero count stays codable.
+class RansFrequencyTable {
+
+public:
+
+    struct EncSymbol {
+        uint32_t x_max; // the state is renormalized while it is >= x_max
+        uint32_t rcp_freq; // fixed point reciprocal of the frequency
+        uint32_t bias;
+        uint16_t cmpl_freq; // 2^scale_bits - freq
+        uint16_t rcp_shift;
+    };
+
+    struct DecSlot {
+        uint16_t freq;
+        uint16_t bias; // slot - start of the symbol
+        uint32_t symbol;
+    };
+
+private:
+
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> freqs;
+    std::vector<EncSymbol> enc_symbols;
+    std::vector<DecSlot> slots;
+    uint32_t scale_bits = rans::MIN_SCALE_BITS;
+
+public:
+
+    RansFrequencyTable() = default;
+
+    explicit RansFrequencyTable(const std::vector<uint32_t>& counts) : counts(counts) {
+        normalize();
+        build_tables();
+    }
+
+    // the count the table was built from
+    uint32_t get(uint32_t symbol) const {
+        return counts[symbol];
+    }
+
+    // the normalized frequency out of 2^scale_bits
+    uint32_t freq(uint32_t symbol) const {
+        return freqs[symbol];
+    }
+
+    size_t size() const {
+        return counts.size();
+    }
+
+    uint32_t get_scale_bits() const {
+        return scale_bits;
+    }
+
+    const EncSymbol& enc_symbol(uint32_t symbol) const {
+        if(freqs[symbol] == 0) {
+            throw std::invalid_argument("RansFrequencyTable: symbol has zero frequency");
+        }
+        return enc_symbols[symbol];
+    }
+
+    // the lookup from each of the 2^scale_bits slots to the symbol covering it
+    const DecSlot* dec_slots() const {
+        return slots.data();
+    }
+
+private:
+
+    void normalize() {
+        freqs.assign(counts.size(), 0);
+
+        uint64_t total = 0;
+        size_t n_used = 0;
+        for(uint32_t c : counts) {
+            total += c;
+            n_used += c > 0;
+        }
+        if(n_used == 0) return;
+
+        // a few bits of headroom over the number of used symbols, so that rare symbols are not inflated too much
+        uint32_t used_bits = 0;
+        while((size_t(1) << used_bits) < n_used) used_bits++;
+        scale_bits = std::clamp(used_bits + 3, rans::MIN_SCALE_BITS, rans::MAX_SCALE_BITS);
+        if(n_used > (size_t(1) << scale_bits)) {
+            // no headroom left, every symbol gets about one slot
+            scale_bits = used_bits;
+        }
+        if(scale_bits > rans::LIMIT_SCALE_BITS) {
+            throw std::invalid_argument("RansFrequencyTable: too many symbols");
+        }
+
+        const int64_t target = int64_t(1) << scale_bits;
+        int64_t sum = 0;
+        for(size_t s = 0; s < counts.size(); s++) {
+            if(counts[s] == 0) continue;
+            freqs[s] = std::max<uint32_t>(1, uint32_t(uint64_t(counts[s]) * target / total));
+            sum += freqs[s];
+        }
+
+        // rounding down leaves a deficit, which goes to the most frequent symbol. the clamping to 1 may cause
+        // an excess instead, which is taken from the most frequent symbols, where it costs the least.
+        std::vector<uint32_t> order(counts.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return freqs[a] > freqs[b]; });
+
+        if(sum < target) {
+            freqs[order[0]] += target - sum;
+        }
+        for(size_t i = 0; sum > target; i = (i + 1) % n_used) {
+            int64_t take = std::min<int64_t>(sum - target, std::max<int64_t>(freqs[order[i]] / 2, 1));
+            take = std::min<int64_t>(take, freqs[order[i]] - 1);
+            freqs[order[i]] -= take;
+            sum -= take;
+        }
+    }
+
+    void build_tables() {
+        enc_symbols.assign(freqs.size(), EncSymbol{});
+        slots.assign(size_t(1) << scale_bits, DecSlot{});
+
+        uint32_t start = 0;
+        for(uint32_t s = 0; s < freqs.size(); s++) {
+            uint32_t f = freqs[s];
+            if(f == 0) continue;
+
+            EncSymbol& e = enc_symbols[s];
+            e.x_max = ((rans::LOWER_BOUND >> scale_bits) << 8) * f;
+            e.cmpl_freq = uint16_t((1u << scale_bits) - f);
+            if(f < 2) {
+                // x / 1 can not be computed with the reciprocal, instead the bias absorbs the multiplication
+                e.rcp_freq = ~0u;
+                e.rcp_shift = 0;
+                e.bias = start + (1u << scale_bits) - 1;
+            }
+            else {
+                uint32_t shift = 0;
+                while(f > (1u << shift)) shift++;
+                e.rcp_freq = uint32_t(((uint64_t(1) << (shift + 31)) + f - 1) / f);
+                e.rcp_shift = shift - 1;
+                e.bias = start;
+            }
+            e.rcp_shift += 32;
+
+            for(uint32_t i = 0; i < f; i++) {
+                slots[start + i] = DecSlot{uint16_t(f), uint16_t(i), s};
+            }
+            start += f;
+        }
+    }
+
+};
+
+// Collects symbols along with their tables and codes them in reverse once finish is called, as rANS requires.
+// The tables have to outlive the call to finish.
+class RansEncoder {
+
+    std::vector<const RansFrequencyTable::EncSymbol*> symbols;
+
+public:
+
+    void write(const RansFrequencyTable& tab, uint32_t symbol) {
+        symbols.push_back(&tab.enc_symbol(symbol));
+    }
+
+    // appends the number of bytes (32 bits) followed by the bytes to bs
+    void finish(BitStream& bs) {
+        using namespace rans;
+
+        // every symbol emits at most two bytes, plus the final states
+        std::vector<uint8_t> buffer(2 * symbols.size() + 4 * LANES);
+        uint8_t* end = buffer.data() + buffer.size();
+        uint8_t* ptr = end;
+
+        uint32_t states[LANES];
+        std::fill(states, states + LANES, LOWER_BOUND);
+
+        for(size_t i = symbols.size(); i-- > 0;) {
+            const auto& sym = *symbols[i];
+            uint32_t& x = states[i % LANES];
+            while(x >= sym.x_max) {
+                *--ptr = uint8_t(x);
+                x >>= 8;
+            }
+            uint32_t q = uint32_t((uint64_t(x) * sym.rcp_freq) >> sym.rcp_shift);
+            x = x + sym.bias + q * sym.cmpl_freq;
+        }
+
+        // the final states are stored big endian, lane 0 first
+        for(size_t l = LANES; l-- > 0;) {
+            for(int b = 0; b < 4; b++) {
+                *--ptr = uint8_t(states[l] >> (8 * b));
+            }
+        }
+
+        bs.append<uint32_t>(end - ptr, 32);
+        BitWriter(bs).write_bytes(ptr, end - ptr);
+
+        symbols.clear();
+    }
+
+};
+
+class RansDecoder {
+
+    std::vector<uint8_t> bytes;
+    size_t pos = 0;
+    uint32_t states[rans::LANES] = {};
+    size_t lane = 0;
+
+public:
+
+    RansDecoder() = default;
+
+    // reads the data written by RansEncoder::finish
+    explicit RansDecoder(BitStreamReader& reader) {
+        uint32_t n_bytes = reader.read32u();
+        bytes.resize(n_bytes);
+        BitReader(reader).read_bytes(bytes.data(), n_bytes);
+        if(n_bytes < 4 * rans::LANES) {
+            throw std::runtime_error("RansDecoder: truncated stream");
+        }
+        for(uint32_t& x : states) {
+            for(int b = 0; b < 4; b++) {
+                x = (x << 8) | bytes[pos++];
+            }
+        }
+    }
+
+    // tab has to be the table the symbol was written with
+    uint32_t read(const RansFrequencyTable& tab) {
+        uint32_t s = decode(states[lane], tab);
+        lane = (lane + 1) % rans::LANES;
+        return s;
+    }
+
+    // decodes n symbols that were all written with tab into out
+    void read(const RansFrequencyTable& tab, size_t n, uint32_t* out) {
+        using namespace rans;
+        size_t i = 0;
+        for(; i < n && lane != 0; i++) {
+            out[i] = read(tab);
+        }
+
+        // all lanes are advanced at once, their dependency chains are independent. a step consumes at most
+        // two bytes per lane, so the bounds only have to be checked once per step.
+        const uint32_t scale_bits = tab.get_scale_bits();
+        const uint32_t mask = (1u << scale_bits) - 1;
+        const RansFrequencyTable::DecSlot* slots = tab.dec_slots();
+        const uint8_t* ptr = bytes.data() + pos;
+        const uint8_t* safe_end = bytes.data() + bytes.size() - std::min(bytes.size(), 2 * LANES);
+        uint32_t x[LANES];
+        std::copy(states, states + LANES, x);
+
+        for(; i + LANES <= n && ptr <= safe_end; i += LANES) {
+            for(size_t l = 0; l < LANES; l++) {
+                const auto& slot = slots[x[l] & mask];
+                x[l] = slot.freq * (x[l] >> scale_bits) + slot.bias;
+                out[i + l] = slot.symbol;
+            }
+            // branch-free renormalization, whether a byte is needed is close to random
+            for(size_t l = 0; l < LANES; l++) {
+                for(int k = 0; k < 2; k++) {
+                    bool refill = x[l] < LOWER_BOUND;
+                    uint32_t refilled = (x[l] << 8) | *ptr;
+                    x[l] = refill ? refilled : x[l];
+                    ptr += refill;
+                }
+            }
+        }
+
+        std::copy(x, x + LANES, states);
+        pos = ptr - bytes.data();
+
+        for(; i < n; i++) {
+            out[i] = read(tab);
+        }
+    }
+
+private:
+
+    uint32_t decode(uint32_t& x, const RansFrequencyTable& tab) {
+        uint32_t scale_bits = tab.get_scale_bits();
+        uint32_t mask = (1u << scale_bits) - 1;
+        const auto& slot = tab.dec_slots()[x & mask];
+        x = slot.freq * (x >> scale_bits) + slot.bias;
+        while(x < rans::LOWER_BOUND) {
+            x = (x << 8) | next_byte();
+        }
+        return slot.symbol;
+    }
+
+    // reading past the end yields zeros, a corrupt stream decodes to garbage instead of reading out of bounds
+    uint8_t next_byte() {
+        return pos < bytes.size() ? bytes[pos++] : 0;
+    }
+
+};
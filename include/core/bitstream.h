@@ -6,6 +6,7 @@
 #include <cstring>
 #include <cstdint>
 #include <fstream>
+#include <algorithm>
 
 // lightweight (but not super efficient) BitStream class, that helps to encode data with odd bit lengths
 struct BitStream {
@@ -21,6 +22,7 @@ struct BitStream {
             data.push_back(0);
         }
 
+        // raw dump of the words in host byte order, see container.h for a portable file format
         static BitStream from_file(std::ifstream& _if) {
             uint32_t n_entries;
             uint32_t head_32;
@@ -146,49 +148,96 @@ struct BitStream {
             std::cout << std::endl;
         }
 
-        std::vector<unsigned char> as_uchar(int read_head) const {
-            assert(size() % 8 == 0);
-            assert(read_head % 8 == 0);
-            std::vector<unsigned char> result;
-            while(read_head < size()) {
-                result.push_back(read<unsigned char>(read_head, 8));
-                read_head += 8;
-            }
-            return result;
-        }
+        // the bytes from read_head (a multiple of 8) to the end of the stream, which has to end on a byte boundary
+        std::vector<unsigned char> as_uchar(size_t read_head) const;
 
-        void append_uchar(const std::vector<unsigned char> data) {
-            for(unsigned char c : data) {
-                append<unsigned char>(c, 8);
-            }
-        }
+        void append_uchar(const std::vector<unsigned char>& data);
 
-        void append_stream(BitStream& other) {
-            size_t head = 0;
-            size_t remaining = other.size();
+        void append_stream(const BitStream& other);
 
-            while(remaining > 64) {
-                append<uint64_t>(other.read<uint64_t>(head, 64), 64);
-                remaining -= 64;
-                head += 64;
-            }
+};
 
-            if(remaining > 0) {
-                append<uint64_t>(other.read<uint64_t>(head, remaining), remaining);
-            }
+// A non-owning view of length bits of a BitStream's words, starting offset bits into them.
+// The view has to be outlived by the stream's data and is invalidated by appending to the stream.
+// Bits past the end of the view read as zeros.
+struct BitStreamView {
+
+    const uint64_t* words = nullptr;
+    size_t offset = 0;
+    size_t length = 0;
+
+    BitStreamView() = default;
+
+    BitStreamView(const uint64_t* words, size_t offset, size_t length) : words(words), offset(offset), length(length) {
+
+    }
+
+    BitStreamView(const BitStream& bs) : words(bs.data.data()), offset(0), length(bs.size()) {
+
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // the bits [start, start + n) of this view
+    BitStreamView subview(size_t start, size_t n) const {
+        assert(start + n <= length);
+        size_t pos = offset + start;
+        return BitStreamView(words + pos / 64, pos % 64, n);
+    }
+
+    // the 64 bits starting at pos
+    uint64_t load(size_t pos) const {
+        if(pos + 64 <= length) {
+            size_t abs = offset + pos;
+            size_t shift = abs % 64;
+            uint64_t res = words[abs / 64] << shift;
+            if(shift > 0) res |= words[abs / 64 + 1] >> (64 - shift);
+            return res;
         }
+        return load_tail(pos);
+    }
+
+    // reads bits (0 ... 64) starting at index
+    template<typename T>
+    T read(size_t index, size_t bits) const {
+        assert(bits <= sizeof(T) * CHAR_BIT && bits <= 64);
+        if(bits == 0) return T(0);
+        return T(load(index) >> (64 - bits));
+    }
+
+private:
+
+    // load for the last 64 bits of the view, which may reach past it
+    uint64_t load_tail(size_t pos) const {
+        if(pos >= length) return 0;
+        size_t abs = offset + pos;
+        size_t i = abs / 64;
+        size_t shift = abs % 64;
+        size_t end_word = (offset + length + 63) / 64; // the words past this one do not belong to the view
+        uint64_t res = words[i] << shift;
+        if(shift > 0 && i + 1 < end_word) res |= words[i + 1] >> (64 - shift);
+        size_t available = length - pos;
+        if(available < 64) res &= ~(~uint64_t(0) >> available);
+        return res;
+    }
 
 };
 
 // keeps track of the read head for you, so that the bitstream can be read from more conveniently
 struct BitStreamReader {
 
-    const BitStream& bs;
+    BitStreamView bs;
     size_t head = 0;
 
 public:
     BitStreamReader(const BitStream& bs) : bs(bs) {
 
+    }
+
+    BitStreamReader(BitStreamView bs) : bs(bs) {
+
     }
     
     template<typename T>
@@ -202,19 +251,21 @@ public:
         return read<bool>(1);
     }
 
+    // returns the next bits without advancing the head. bits past the end of the stream read as zeros.
+    template<typename T>
+    T peek(size_t bits) const {
+        return bs.read<T>(head, bits);
+    }
+
+    void skip(size_t bits) {
+        head += bits;
+    }
+
     bool empty() {
         return head >= bs.size();
     }
 
-    // TODO: probably can optimize this by batching reads
-    std::vector<bool> read_bits(size_t bits) {
-        std::vector<bool> res;
-        res.reserve(bits);
-        for(size_t i = 0; i < bits; i++) {
-            res.push_back(read<bool>(1));
-        }
-        return res;
-    }
+    std::vector<bool> read_bits(size_t bits);
 
     uint8_t read8u(size_t bits = 8) {
         return read<uint8_t>(bits);
@@ -228,16 +279,273 @@ public:
         return read<uint32_t>(bits);
     }
 
-    // TODO: return a view into a BitStream instead
-    BitStream read_substream(size_t n_bits) {
-        BitStream out;
-        while(n_bits - out.size() >= 64) {
-            out.append<uint64_t>(read<uint64_t>(64), 64);
+    // a copy of the next n_bits bits
+    BitStream read_substream(size_t n_bits);
+
+    // the next n_bits bits, read in place
+    BitStreamView read_view(size_t n_bits) {
+        BitStreamView res = bs.subview(head, n_bits);
+        head += n_bits;
+        return res;
+    }
+
+};
+
+// Appends bits to a BitStream through a 64-bit accumulator, so that the stream is only touched once per 64 bits.
+// The stream is brought up to date by finish (or the destructor), it must not be accessed in between.
+class BitWriter {
+
+    BitStream* bs;
+    uint64_t acc; // the bits of the last, incomplete word of the stream, msb aligned
+    size_t fill; // the number of bits in acc
+
+public:
+
+    explicit BitWriter(BitStream& bs) : bs(&bs), acc(bs.data.back()), fill(bs.head) {
+
+    }
+
+    BitWriter(const BitWriter&) = delete;
+    BitWriter& operator=(const BitWriter&) = delete;
+
+    ~BitWriter() {
+        finish();
+    }
+
+    // appends the trailing bits (0 ... 64) of value, which can only contain one-bits in these
+    void write(uint64_t value, size_t bits) {
+        assert(bits <= 64 && (bits == 64 || (value >> bits) == 0));
+        if(bits == 0) return; // the shifts below are undefined for 64 - 0 bits
+        size_t free = 64 - fill;
+        if(bits < free) {
+            acc |= value << (free - bits);
+            fill += bits;
+            return;
         }
-        if((n_bits - out.size()) > 0) {
-            out.append<uint64_t>(read<uint64_t>(n_bits - out.size()), n_bits - out.size());
+        // the word is completed, the stream keeps an (empty) slot for the incomplete word
+        acc |= value >> (bits - free);
+        bs->data.back() = acc;
+        bs->data.push_back(0);
+        fill = bits - free;
+        acc = fill > 0 ? value << (64 - fill) : 0;
+    }
+
+    void write_bit(bool b) {
+        write(b, 1);
+    }
+
+    // appends n_bits bits, packed msb first into words
+    void write_bits(const uint64_t* words, size_t n_bits) {
+        size_t full = n_bits / 64;
+        if(fill == 0) {
+            // aligned, the words are copied as is
+            bs->data.back() = full > 0 ? words[0] : 0;
+            bs->data.insert(bs->data.end(), words + std::min<size_t>(full, 1), words + full);
+            if(full > 0) bs->data.push_back(0);
         }
-        return out;
+        else {
+            for(size_t i = 0; i < full; i++) write(words[i], 64);
+        }
+        size_t rest = n_bits % 64;
+        if(rest > 0) write(words[full] >> (64 - rest), rest);
+    }
+
+    void write_bytes(const uint8_t* bytes, size_t n) {
+        size_t i = 0;
+        for(; i + 8 <= n; i += 8) {
+            uint64_t word = 0;
+            for(int b = 0; b < 8; b++) {
+                word = (word << 8) | bytes[i + b];
+            }
+            write(word, 64);
+        }
+        for(; i < n; i++) {
+            write(bytes[i], 8);
+        }
+    }
+
+    // brings the stream up to date, further writes are ignored
+    void finish() {
+        if(!bs) return;
+        bs->data.back() = acc;
+        bs->head = fill;
+        bs = nullptr;
+    }
+
+};
+
+// Reads bits from a BitStream through a 64-bit accumulator, which is refilled a word at a time when it runs low.
+// peek and consume allow table driven decoders to look ahead. Bits past the end of the stream read as zeros.
+// If constructed from a BitStreamReader, its head is advanced by the consumed bits in finish (or the destructor),
+// the reader must not be used in between.
+class BitReader {
+
+    BitStreamView bs;
+    BitStreamReader* reader = nullptr;
+    size_t bit_pos; // the position of the first bit that is not in acc
+    uint64_t acc = 0; // msb aligned
+    uint32_t acc_bits = 0;
+
+public:
+
+    static constexpr uint32_t MAX_PEEK_BITS = 56;
+
+    explicit BitReader(BitStreamView bs, size_t head = 0) : bs(bs), bit_pos(head) {
+
+    }
+
+    explicit BitReader(BitStreamReader& reader);
+
+    BitReader(const BitReader&) = delete;
+    BitReader& operator=(const BitReader&) = delete;
+
+    ~BitReader() {
+        finish();
+    }
+
+    size_t position() const {
+        return bit_pos - acc_bits;
+    }
+
+    bool empty() const {
+        return position() >= bs.size();
+    }
+
+    // the next bits (1 ... MAX_PEEK_BITS) without consuming them
+    uint64_t peek(uint32_t bits) {
+        assert(bits > 0 && bits <= MAX_PEEK_BITS);
+        if(acc_bits < bits) refill();
+        return acc >> (64 - bits);
+    }
+
+    // drops bits that have been peeked
+    void consume(uint32_t bits) {
+        assert(bits <= acc_bits);
+        acc = bits < 64 ? acc << bits : 0;
+        acc_bits -= bits;
     }
 
-};
\ No newline at end of file
+    // reads 0 ... 64 bits
+    uint64_t read(uint32_t bits) {
+        if(bits == 0) return 0;
+        if(bits > MAX_PEEK_BITS) {
+            uint64_t hi = peek(32);
+            consume(32);
+            uint64_t lo = peek(bits - 32);
+            consume(bits - 32);
+            return (hi << (bits - 32)) | lo;
+        }
+        uint64_t res = peek(bits);
+        consume(bits);
+        return res;
+    }
+
+    bool read_bit() {
+        return read(1);
+    }
+
+    // reads n_bits bits into words, packed msb first. The last word is padded with zeros.
+    void read_bits(uint64_t* words, size_t n_bits) {
+        seek(position());
+        size_t full = n_bits / 64;
+        for(size_t i = 0; i < full; i++) {
+            words[i] = load(bit_pos);
+            bit_pos += 64;
+        }
+        size_t rest = n_bits % 64;
+        if(rest > 0) {
+            words[full] = load(bit_pos) >> (64 - rest) << (64 - rest);
+            bit_pos += rest;
+        }
+    }
+
+    void read_bytes(uint8_t* bytes, size_t n) {
+        size_t i = 0;
+        for(; i + 8 <= n; i += 8) {
+            uint64_t word = read(64);
+            for(int b = 0; b < 8; b++) {
+                bytes[i + b] = uint8_t(word >> (56 - 8 * b));
+            }
+        }
+        for(; i < n; i++) {
+            bytes[i] = read(8);
+        }
+    }
+
+    // continues reading at the given position
+    void seek(size_t pos) {
+        bit_pos = pos;
+        acc = 0;
+        acc_bits = 0;
+    }
+
+    // advances the BitStreamReader this was constructed from (if any) to the current position
+    void finish();
+
+private:
+
+    // fills the accumulator up to 64 bits
+    void refill() {
+        acc |= load(bit_pos) >> acc_bits;
+        bit_pos += 64 - acc_bits;
+        acc_bits = 64;
+    }
+
+    uint64_t load(size_t pos) const {
+        return bs.load(pos);
+    }
+
+};
+
+inline BitReader::BitReader(BitStreamReader& reader) : bs(reader.bs), reader(&reader), bit_pos(reader.head) {
+
+}
+
+inline void BitReader::finish() {
+    if(!reader) return;
+    reader->head = position();
+    reader = nullptr;
+}
+
+inline std::vector<unsigned char> BitStream::as_uchar(size_t read_head) const {
+    assert(size() % 8 == 0);
+    assert(read_head % 8 == 0);
+    std::vector<unsigned char> result((size() - read_head) / 8);
+    BitReader reader(*this, read_head);
+    reader.read_bytes(result.data(), result.size());
+    return result;
+}
+
+inline void BitStream::append_uchar(const std::vector<unsigned char>& data) {
+    BitWriter writer(*this);
+    writer.write_bytes(data.data(), data.size());
+}
+
+inline void BitStream::append_stream(const BitStream& other) {
+    BitWriter writer(*this);
+    writer.write_bits(other.data.data(), other.size());
+}
+
+inline std::vector<bool> BitStreamReader::read_bits(size_t bits) {
+    std::vector<uint64_t> words(bits / 64 + 1);
+    {
+        BitReader reader(*this);
+        reader.read_bits(words.data(), bits);
+    }
+    std::vector<bool> res(bits);
+    for(size_t i = 0; i < bits; i++) {
+        res[i] = (words[i / 64] >> (63 - i % 64)) & 0b1;
+    }
+    return res;
+}
+
+inline BitStream BitStreamReader::read_substream(size_t n_bits) {
+    BitStream out;
+    out.data.resize(n_bits / 64 + 1);
+    {
+        BitReader reader(*this);
+        reader.read_bits(out.data.data(), n_bits);
+    }
+    out.head = n_bits % 64;
+    return out;
+}
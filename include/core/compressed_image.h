@@ -4,63 +4,72 @@
 #include "timing.h"
 #include "codec.h"
 #include "diagnostics.h"
-
-#include <zlib.h>
+#include "deflate_stage.h"
 
 using namespace util;
 
 struct CompressedMulticutImage : MulticutImage {
 
+    // the level the encoded image is deflated with, decoding works for any level
+    deflate_stage::Level level = deflate_stage::AUTO;
+
     CompressedMulticutImage() = default;
 
     CompressedMulticutImage(cv::Mat mask, cv::Mat img) : MulticutImage(mask, img) {};
 
-    CompressedMulticutImage(const CompressedMulticutImage& other) : MulticutImage(mask.clone(), img) {};
+    CompressedMulticutImage(const CompressedMulticutImage& other) : MulticutImage(mask.clone(), img), level(other.level) {};
 
     CompressedMulticutImage(
-        const BitStream& stream,
+        BitStreamView stream,
         PartitionCodecBase* partition_codec,
         MulticutCodecBase* multicut_codec) {
-            BitStreamReader reader(stream);
-            uLongf uncompressed_length = reader.read32u();
-            BitStream compressed_stream = reader.read_substream(reader.bs.size() - reader.head);
-            std::vector<unsigned char> compressed_data = compressed_stream.as_uchar(0);
-    
-            unsigned char* uncompressed_buf = new unsigned char[uncompressed_length];
-            int status = uncompress(uncompressed_buf, &uncompressed_length, compressed_data.data(), compressed_data.size());
-    
-            std::vector<unsigned char> uncompressed_data(uncompressed_buf, uncompressed_buf + uncompressed_length);
-            BitStream uncompressed_stream;
-            uncompressed_stream.append_uchar(uncompressed_data);
-            delete uncompressed_buf;
-    
-            MulticutImage result = MulticutImage(uncompressed_stream, partition_codec, multicut_codec);
+            MulticutImage result = MulticutImage(uncompress(stream), partition_codec, multicut_codec);
             this->img = result.img;
             this->mask = result.mask;
         };
 
+    // the deflate stage has no random access, so the whole stream is inflated before the region is decoded
+    // (Codec does not deflate the streams of multicut codecs with random access for this reason)
+    static MulticutImage decode_region(
+        BitStreamView stream,
+        cv::Rect roi,
+        PartitionCodecBase* partition_codec,
+        MulticutCodecBase* multicut_codec) {
+            return MulticutImage::decode_region(uncompress(stream), roi, partition_codec, multicut_codec);
+        }
+
+    // the stream MulticutImage encoded, before it was compressed
+    static BitStream uncompress(BitStreamView stream) {
+        BitStreamReader reader(stream);
+        size_t uncompressed_length = reader.read32u();
+
+        // the zlib stream is inflated straight from the stream into the words of the uncompressed stream
+        BitStream uncompressed_stream;
+        uncompressed_stream.data.reserve(uncompressed_length / 8 + 2);
+        BitWriter writer(uncompressed_stream);
+        deflate_stage::decompress(reader.read_view((reader.bs.size() - reader.head) / 8 * 8), writer);
+        writer.finish();
+        return uncompressed_stream;
+    }
+
     virtual void encode(
         Multicut &multicut,
         BitStream& out_stream,
         PartitionCodecBase* partition_codec,
-        MulticutCodecBase* multicut_codec
+        MulticutCodecBase* multicut_codec,
+        bool codec_initialized = false
     )
     {
         BitStream uncompressed;
-        MulticutImage::encode(multicut, uncompressed, partition_codec, multicut_codec);
+        MulticutImage::encode(multicut, uncompressed, partition_codec, multicut_codec, codec_initialized);
         uncompressed.pad_to_bytes();
 
         pprintln("uncompressed size: ", uncompressed.size());
 
-        std::vector<unsigned char> uncompressed_data = uncompressed.as_uchar(0);
-        unsigned long buf_size = uncompressed_data.size() * 2 + 20;
-        unsigned char* buf = new unsigned char[buf_size];
-
-        int status = compress(buf, &buf_size, uncompressed_data.data(), uncompressed_data.size());
-        std::vector<unsigned char> compressed_data(buf, buf + buf_size);
-        out_stream.append<uint32_t>(uncompressed_data.size(), 32);
-        out_stream.append_uchar(compressed_data);
-        delete buf;
+        out_stream.append<uint32_t>(uncompressed.size() / 8, 32);
+        BitWriter writer(out_stream);
+        deflate_stage::compress(uncompressed, writer, level);
+        writer.finish();
 
         DIAGNOSTICS_MESSAGE("compressed_multicut_image_bits", out_stream.size());
     }
@@ -0,0 +1,378 @@
+#pragma once
+#include "bitstream.h"
+
+#include <zlib.h>
+
+#include <bit>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #define CONTAINER_HAS_MMAP
+#endif
+
+// A versioned, byte exact file format for encoded images, which does not depend on the endianness of the machine.
+// All integers are little endian. The layout is:
+//
+//   file header (32 bytes):  magic "MCIC" | u16 version | u16 flags | u32 rows | u32 cols
+//                            | u16 partition codec id | u16 multicut codec id | u32 n_chunks | u32 reserved (0)
+//                            | u32 crc32 of the first 28 bytes
+//   chunk table (24 bytes per chunk):  u32 type | u32 crc32 of the chunk data | u64 offset | u64 n_bits
+//   chunk data:  ceil(n_bits / 64) u64 words per chunk, holding the bits msb first like the words of a BitStream.
+//                Every chunk starts at an offset that is a multiple of 8.
+//
+// As the words are stored in the layout BitStream uses on little endian machines, a chunk of a memory mapped file
+// can be read in place through a BitStreamView (see ContainerReader).
+namespace container {
+
+    constexpr char MAGIC[4] = {'M', 'C', 'I', 'C'};
+    constexpr uint16_t VERSION = 1;
+
+    constexpr size_t HEADER_SIZE = 32;
+    constexpr size_t CHUNK_ENTRY_SIZE = 24;
+
+    // the image was zlib compressed after encoding (see CompressedMulticutImage)
+    constexpr uint16_t FLAG_COMPRESSED = 0b1;
+
+    constexpr uint32_t fourcc(const char (&s)[5]) {
+        return uint32_t(uint8_t(s[0])) | uint32_t(uint8_t(s[1])) << 8 | uint32_t(uint8_t(s[2])) << 16 | uint32_t(uint8_t(s[3])) << 24;
+    }
+
+    // a complete encoded image, as produced by Codec::optimize_encode
+    constexpr uint32_t CHUNK_IMAGE = fourcc("IMG ");
+
+    // the configuration of the codecs the image was written with as text, one byte per 8 bits (see Codec::make_container)
+    constexpr uint32_t CHUNK_CONFIG = fourcc("CONF");
+
+    // codec ids stored in the header, UNKNOWN_CODEC is used for codecs without an id.
+    // the ids only tell the codec types apart, their parameters are stored in the CHUNK_CONFIG chunk.
+    constexpr uint16_t UNKNOWN_CODEC = 0;
+
+    enum PartitionCodecId : uint16_t {
+        MEAN_CODEC = 1,
+        DIFFERENTIAL_MEAN_CODEC = 2
+    };
+
+    enum MulticutCodecId : uint16_t {
+        DEFAULT_MULTICUT_CODEC = 1,
+        DYNAMIC_HUFFMAN_CODEC = 2,
+        BORDER_CODEC = 3,
+        MULTICUT_AWARE_CODEC = 4,
+        TILED_MULTICUT_CODEC = 5
+    };
+
+    template<typename T>
+    void store_le(uint8_t* dst, T v) {
+        for(size_t i = 0; i < sizeof(T); i++) {
+            dst[i] = uint8_t(uint64_t(v) >> (8 * i));
+        }
+    }
+
+    template<typename T>
+    T load_le(const uint8_t* src) {
+        uint64_t v = 0;
+        for(size_t i = 0; i < sizeof(T); i++) {
+            v |= uint64_t(src[i]) << (8 * i);
+        }
+        return T(v);
+    }
+
+    inline uint32_t crc(const uint8_t* data, size_t size) {
+        uLong c = crc32(0L, Z_NULL, 0);
+        // zlib takes the length as uInt, so large chunks are processed piecewise
+        while(size > 0) {
+            uInt n = uInt(std::min<size_t>(size, 1u << 30));
+            c = crc32(c, data, n);
+            data += n;
+            size -= n;
+        }
+        return uint32_t(c);
+    }
+
+}
+
+struct ContainerInfo {
+    uint16_t flags = 0;
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint16_t partition_codec = container::UNKNOWN_CODEC;
+    uint16_t multicut_codec = container::UNKNOWN_CODEC;
+};
+
+class ContainerWriter {
+
+    struct Chunk {
+        uint32_t type;
+        std::vector<uint64_t> words;
+        uint64_t n_bits;
+    };
+
+    ContainerInfo info;
+    std::vector<Chunk> chunks;
+
+public:
+
+    explicit ContainerWriter(const ContainerInfo& info) : info(info) {
+
+    }
+
+    void add_chunk(uint32_t type, const BitStream& bs) {
+        size_t n_words = (bs.size() + 63) / 64;
+        chunks.push_back({type, std::vector<uint64_t>(bs.data.begin(), bs.data.begin() + n_words), bs.size()});
+    }
+
+    std::vector<uint8_t> serialize() const {
+        using namespace container;
+
+        size_t size = HEADER_SIZE + CHUNK_ENTRY_SIZE * chunks.size();
+        std::vector<size_t> offsets;
+        for(const Chunk& chunk : chunks) {
+            offsets.push_back(size);
+            size += 8 * chunk.words.size();
+        }
+
+        std::vector<uint8_t> res(size, 0);
+        uint8_t* header = res.data();
+        std::memcpy(header, MAGIC, 4);
+        store_le<uint16_t>(header + 4, VERSION);
+        store_le<uint16_t>(header + 6, info.flags);
+        store_le<uint32_t>(header + 8, info.rows);
+        store_le<uint32_t>(header + 12, info.cols);
+        store_le<uint16_t>(header + 16, info.partition_codec);
+        store_le<uint16_t>(header + 18, info.multicut_codec);
+        store_le<uint32_t>(header + 20, chunks.size());
+        store_le<uint32_t>(header + 24, 0); // reserved
+        store_le<uint32_t>(header + 28, crc(header, 28));
+
+        for(size_t i = 0; i < chunks.size(); i++) {
+            uint8_t* data = res.data() + offsets[i];
+            for(size_t w = 0; w < chunks[i].words.size(); w++) {
+                store_le<uint64_t>(data + 8 * w, chunks[i].words[w]);
+            }
+
+            uint8_t* entry = res.data() + HEADER_SIZE + CHUNK_ENTRY_SIZE * i;
+            store_le<uint32_t>(entry, chunks[i].type);
+            store_le<uint32_t>(entry + 4, crc(data, 8 * chunks[i].words.size()));
+            store_le<uint64_t>(entry + 8, offsets[i]);
+            store_le<uint64_t>(entry + 16, chunks[i].n_bits);
+        }
+
+        return res;
+    }
+
+    void write(const std::string& path) const {
+        std::vector<uint8_t> bytes = serialize();
+        std::ofstream out(path, std::ofstream::binary);
+        out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        if(!out) {
+            throw std::runtime_error("ContainerWriter: unable to write " + path);
+        }
+    }
+
+};
+
+// Reads a container from a memory mapped file, or from memory owned by the caller. The chunks are accessed in place,
+// unless the machine is big endian (or has no mmap), in which case the file is read into memory once.
+class ContainerReader {
+
+    struct Chunk {
+        uint32_t type;
+        uint32_t crc;
+        uint64_t offset;
+        uint64_t n_bits;
+    };
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    void* mapping = nullptr; // set if data is a mapping owned by this reader
+    std::vector<uint64_t> buffer; // set if data is a copy owned by this reader, 8 byte aligned
+
+    ContainerInfo header;
+    std::vector<Chunk> chunks;
+
+    ContainerReader() = default;
+
+public:
+
+    static constexpr size_t npos = size_t(-1);
+
+    // the memory has to be 8 byte aligned and outlive the reader
+    static ContainerReader from_memory(const uint8_t* data, size_t size) {
+        if(reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+            throw std::invalid_argument("ContainerReader: the data has to be 8 byte aligned");
+        }
+        ContainerReader res;
+        res.data = data;
+        res.size = size;
+        res.parse();
+        return res;
+    }
+
+    static ContainerReader open(const std::string& path) {
+        ContainerReader res;
+#ifdef CONTAINER_HAS_MMAP
+        if constexpr(std::endian::native == std::endian::little) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0) throw std::runtime_error("ContainerReader: unable to open " + path);
+            struct stat st;
+            if(fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw std::runtime_error("ContainerReader: unable to stat " + path);
+            }
+            res.size = st.st_size;
+            if(res.size > 0) {
+                void* m = mmap(nullptr, res.size, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+                if(m == MAP_FAILED) throw std::runtime_error("ContainerReader: unable to map " + path);
+                res.mapping = m;
+                res.data = static_cast<const uint8_t*>(m);
+            }
+            else {
+                ::close(fd);
+            }
+            res.parse();
+            return res;
+        }
+#endif
+        std::ifstream in(path, std::ifstream::binary | std::ifstream::ate);
+        if(!in) throw std::runtime_error("ContainerReader: unable to open " + path);
+        res.size = in.tellg();
+        res.buffer.resize((res.size + 7) / 8);
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(res.buffer.data()), res.size);
+        res.data = reinterpret_cast<const uint8_t*>(res.buffer.data());
+        res.parse();
+        return res;
+    }
+
+    ContainerReader(const ContainerReader&) = delete;
+    ContainerReader& operator=(const ContainerReader&) = delete;
+
+    ContainerReader(ContainerReader&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    ContainerReader& operator=(ContainerReader&& other) noexcept {
+        if(this == &other) return *this;
+        release();
+        data = std::exchange(other.data, nullptr);
+        size = std::exchange(other.size, 0);
+        mapping = std::exchange(other.mapping, nullptr);
+        buffer = std::move(other.buffer);
+        header = other.header;
+        chunks = std::move(other.chunks);
+        return *this;
+    }
+
+    ~ContainerReader() {
+        release();
+    }
+
+    const ContainerInfo& info() const {
+        return header;
+    }
+
+    size_t n_chunks() const {
+        return chunks.size();
+    }
+
+    uint32_t chunk_type(size_t i) const {
+        return chunks.at(i).type;
+    }
+
+    // the index of the first chunk of the given type, npos if there is none
+    size_t find(uint32_t type) const {
+        for(size_t i = 0; i < chunks.size(); i++) {
+            if(chunks[i].type == type) return i;
+        }
+        return npos;
+    }
+
+    // checks the crc of the chunk's data
+    bool verify(size_t i) const {
+        const Chunk& chunk = chunks.at(i);
+        return container::crc(data + chunk.offset, 8 * ((chunk.n_bits + 63) / 64)) == chunk.crc;
+    }
+
+    // the bits of the chunk, read in place
+    BitStreamView chunk(size_t i) const {
+        const Chunk& chunk = chunks.at(i);
+        return BitStreamView(reinterpret_cast<const uint64_t*>(data + chunk.offset), 0, chunk.n_bits);
+    }
+
+private:
+
+    void parse() {
+        using namespace container;
+
+        if(size < HEADER_SIZE || std::memcmp(data, MAGIC, 4) != 0) {
+            throw std::runtime_error("ContainerReader: not a container");
+        }
+        if(load_le<uint32_t>(data + 28) != crc(data, 28)) {
+            throw std::runtime_error("ContainerReader: corrupt header");
+        }
+        uint16_t version = load_le<uint16_t>(data + 4);
+        if(version != VERSION) {
+            throw std::runtime_error("ContainerReader: unsupported version " + std::to_string(version));
+        }
+
+        header.flags = load_le<uint16_t>(data + 6);
+        header.rows = load_le<uint32_t>(data + 8);
+        header.cols = load_le<uint32_t>(data + 12);
+        header.partition_codec = load_le<uint16_t>(data + 16);
+        header.multicut_codec = load_le<uint16_t>(data + 18);
+
+        uint32_t n = load_le<uint32_t>(data + 20);
+        if(n > (size - HEADER_SIZE) / CHUNK_ENTRY_SIZE) {
+            throw std::runtime_error("ContainerReader: truncated chunk table");
+        }
+
+        for(uint32_t i = 0; i < n; i++) {
+            const uint8_t* entry = data + HEADER_SIZE + CHUNK_ENTRY_SIZE * i;
+            Chunk chunk;
+            chunk.type = load_le<uint32_t>(entry);
+            chunk.crc = load_le<uint32_t>(entry + 4);
+            chunk.offset = load_le<uint64_t>(entry + 8);
+            chunk.n_bits = load_le<uint64_t>(entry + 16);
+
+            uint64_t n_bytes = 8 * ((chunk.n_bits + 63) / 64);
+            if(chunk.offset % 8 != 0 || chunk.offset > size || n_bytes > size - chunk.offset) {
+                throw std::runtime_error("ContainerReader: chunk out of bounds");
+            }
+            chunks.push_back(chunk);
+        }
+
+        // the words are stored little endian, big endian machines work on a swapped copy
+        if constexpr(std::endian::native == std::endian::big) {
+            if(buffer.empty()) {
+                buffer.resize((size + 7) / 8);
+                std::memcpy(buffer.data(), data, size);
+                data = reinterpret_cast<const uint8_t*>(buffer.data());
+            }
+            for(const Chunk& chunk : chunks) {
+                uint64_t* words = reinterpret_cast<uint64_t*>(buffer.data()) + chunk.offset / 8;
+                for(size_t w = 0; w < (chunk.n_bits + 63) / 64; w++) {
+                    words[w] = load_le<uint64_t>(reinterpret_cast<const uint8_t*>(words + w));
+                }
+            }
+        }
+    }
+
+    void release() {
+#ifdef CONTAINER_HAS_MMAP
+        if(mapping) munmap(mapping, size);
+#endif
+        mapping = nullptr;
+    }
+
+};
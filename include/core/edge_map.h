@@ -0,0 +1,165 @@
+#pragma once
+#include <opencv2/core/mat.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// The edges of the pixel grid of a mask, as packed bitplanes. A set bit marks a joined edge (both pixels carry the
+// same label), a cleared bit a cut. Bits are packed msb first, bit 63 of the first word of a row is column 0, so
+// that rows can be passed to BitWriter::write_bits as they are. The bits past the end of a row are zero.
+//  horizontal(r, c): (r, c) - (r, c+1), for c < cols-1
+//  vertical(r, c):   (r, c) - (r+1, c), for r < rows-1
+// Computing the map once lets several multicut codecs encode the same mask without comparing labels again.
+struct EdgeMap {
+
+    int rows = 0;
+    int cols = 0;
+    size_t words_per_row = 0;
+    std::vector<uint64_t> h; // rows x words_per_row
+    std::vector<uint64_t> v; // (rows-1) x words_per_row
+
+    EdgeMap() = default;
+
+    // all edges cut
+    EdgeMap(int rows, int cols) : rows(rows), cols(cols), words_per_row((cols + 63) / 64),
+        h(size_t(rows) * words_per_row, 0), v(size_t(std::max(rows - 1, 0)) * words_per_row, 0) {
+
+    }
+
+    // mask has to be CV_32S
+    explicit EdgeMap(const cv::Mat& mask) : EdgeMap(mask.rows, mask.cols) {
+        for(int r = 0; r < rows; r++) {
+            const int32_t* row = mask.ptr<int32_t>(r);
+            pack_equal(row, row + 1, cols - 1, horizontal_row(r));
+            if(r + 1 < rows) {
+                pack_equal(row, mask.ptr<int32_t>(r + 1), cols, vertical_row(r));
+            }
+        }
+    }
+
+    bool horizontal(int r, int c) const {
+        return get(h.data() + r * words_per_row, c);
+    }
+
+    bool vertical(int r, int c) const {
+        return get(v.data() + r * words_per_row, c);
+    }
+
+    void set_horizontal(int r, int c, bool joined) {
+        set(h.data() + r * words_per_row, c, joined);
+    }
+
+    void set_vertical(int r, int c, bool joined) {
+        set(v.data() + r * words_per_row, c, joined);
+    }
+
+    uint64_t* horizontal_row(int r) { return h.data() + r * words_per_row; }
+    const uint64_t* horizontal_row(int r) const { return h.data() + r * words_per_row; }
+    uint64_t* vertical_row(int r) { return v.data() + r * words_per_row; }
+    const uint64_t* vertical_row(int r) const { return v.data() + r * words_per_row; }
+
+    // the edges inside rect, as if the mask had been cropped to it
+    EdgeMap crop(const cv::Rect& rect) const {
+        EdgeMap res(rect.height, rect.width);
+        for(int r = 0; r < res.rows; r++) {
+            copy_bits(horizontal_row(rect.y + r), rect.x, res.cols - 1, res.horizontal_row(r));
+            if(r + 1 < res.rows) {
+                copy_bits(vertical_row(rect.y + r), rect.x, res.cols, res.vertical_row(r));
+            }
+        }
+        return res;
+    }
+
+    // copies the edges of tile into the rect of its size at (y, x), the inverse of crop
+    void paste(const EdgeMap& tile, int y, int x) {
+        for(int r = 0; r < tile.rows; r++) {
+            insert_bits(horizontal_row(y + r), x, tile.cols - 1, tile.horizontal_row(r));
+            if(r + 1 < tile.rows) {
+                insert_bits(vertical_row(y + r), x, tile.cols, tile.vertical_row(r));
+            }
+        }
+    }
+
+    // writes the bits a[i] == b[i] for i < n msb first to out
+    static void pack_equal(const int32_t* a, const int32_t* b, int n, uint64_t* out) {
+        if(n <= 0) return;
+        for(int w = 0; w * 64 < n; w++) {
+            int begin = w * 64;
+            int end = std::min(n, begin + 64);
+            uint64_t word = 0; // lsb first, reversed once complete
+            int i = begin;
+#ifdef __AVX2__
+            for(; i + 8 <= end; i += 8) {
+                __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+                __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+                uint32_t eq = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x, y)));
+                word |= uint64_t(eq) << (i - begin);
+            }
+#endif
+            for(; i < end; i++) {
+                word |= uint64_t(a[i] == b[i]) << (i - begin);
+            }
+            out[w] = reverse_bits(word);
+        }
+    }
+
+private:
+
+    static bool get(const uint64_t* row, int c) {
+        return (row[c >> 6] >> (63 - (c & 63))) & 1;
+    }
+
+    static void set(uint64_t* row, int c, bool b) {
+        uint64_t bit = uint64_t(1) << (63 - (c & 63));
+        row[c >> 6] = b ? row[c >> 6] | bit : row[c >> 6] & ~bit;
+    }
+
+    static uint64_t reverse_bits(uint64_t x) {
+        x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+        x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+        x = ((x >> 8) & 0x00FF00FF00FF00FFull) | ((x & 0x00FF00FF00FF00FFull) << 8);
+        x = ((x >> 16) & 0x0000FFFF0000FFFFull) | ((x & 0x0000FFFF0000FFFFull) << 16);
+        return (x >> 32) | (x << 32);
+    }
+
+    // copies the n bits of src starting at bit start to the start of dst, the bits past n are cleared
+    static void copy_bits(const uint64_t* src, int start, int n, uint64_t* dst) {
+        if(n <= 0) return;
+        int shift = start & 63;
+        const uint64_t* s = src + (start >> 6);
+        int n_words = (n + 63) / 64;
+        for(int w = 0; w < n_words; w++) {
+            uint64_t word = s[w] << shift;
+            // the next source word only exists if the copied bits reach into it
+            if(shift > 0 && (w + 1) * 64 - shift < n) {
+                word |= s[w + 1] >> (64 - shift);
+            }
+            dst[w] = word;
+        }
+        if(n % 64 != 0) {
+            dst[n_words - 1] &= ~uint64_t(0) << (64 - n % 64);
+        }
+    }
+
+    // overwrites the n bits of dst starting at bit start with the first n bits of src
+    static void insert_bits(uint64_t* dst, int start, int n, const uint64_t* src) {
+        int shift = start & 63;
+        uint64_t* d = dst + (start >> 6);
+        for(int w = 0; w * 64 < n; w++) {
+            int len = std::min(64, n - w * 64);
+            uint64_t keep = ~uint64_t(0) << (64 - len); // the len leading bits
+            uint64_t bits = src[w] & keep;
+            d[w] = (d[w] & ~(keep >> shift)) | (bits >> shift);
+            if(shift > 0 && len > 64 - shift) {
+                d[w + 1] = (d[w + 1] & ~(keep << (64 - shift))) | (bits << (64 - shift));
+            }
+        }
+    }
+
+};
@@ -4,7 +4,9 @@
 #include "mean_codec.h"
 #include "multicut_codec.h"
 #include "compressed_image.h"
+#include "container.h"
 #include "multicut_aware_codec.h"
+#include "tiled_codec.h"
 
 
 class Codec {
@@ -13,6 +15,7 @@ class Codec {
     std::unique_ptr<PartitionCodecBase> partition_codec;
     std::unique_ptr<MulticutCodecBase> multicut_codec;
     bool compressed = true;
+    deflate_stage::Level compression_level = deflate_stage::AUTO;
 
     friend class CodecBuilder;
 
@@ -20,16 +23,7 @@ public:
 
     BitStream encode_from_mask(const cv::Mat& img, const cv::Mat& mask) const {
         Multicut mc(mask);
-        BitStream res;
-
-        if(compressed) {
-            CompressedMulticutImage mc_img(mask, img);
-            mc_img.encode(mc, res, partition_codec->clone().get(), multicut_codec->clone().get());
-        } else {
-            MulticutImage mc_img(mask, img);
-            mc_img.encode(mc, res, partition_codec->clone().get(), multicut_codec->clone().get());
-        }
-        return res;
+        return encode_multicut(img, mc, partition_codec->clone().get(), false);
     }
 
     BitStream encode_from_multicut(const cv::Mat& img, const Multicut& mc) const {
@@ -37,8 +31,7 @@ public:
     }
 
     BitStream optimize_encode(const cv::Mat& img) const {
-        auto mc = optimize(img);
-        return encode_from_mask(img, mc.mask);
+        return optimize_encode(img, MulticutImage::get_default_mask(img, 1));
     };
 
     Multicut optimize(const cv::Mat& img) const {
@@ -49,9 +42,16 @@ public:
         return optimizer->optimize(img, mask);
     }
 
+    // encodes the optimizer's result directly. if the optimizer passes on a partition codec of the
+    // same type, its statistics are reused instead of initializing a fresh codec from the pixels.
     BitStream optimize_encode(const cv::Mat& img, const cv::Mat& mask) const {
-        auto mc = optimize(img, mask);
-        return encode_from_mask(img, mc.mask);
+        OptimizedMulticut res = optimizer->optimize_for_encoding(img, mask);
+
+        if(res.partition_codec && typeid(*res.partition_codec) == typeid(*partition_codec) &&
+           res.partition_codec->rebind(&res.multicut, &img, res.old_to_new)) {
+            return encode_multicut(img, res.multicut, res.partition_codec.get(), true);
+        }
+        return encode_multicut(img, res.multicut, partition_codec->clone().get(), false);
     };
 
     std::pair<cv::Mat, size_t> optimize_and_get_mask_with_size(const cv::Mat& img) const {
@@ -61,15 +61,150 @@ public:
         return std::make_pair(mc.mask, bs.size());
     }
 
-    std::unique_ptr<MulticutImage> decode(const BitStream& bs) const {
-        if(compressed) {
+    std::unique_ptr<MulticutImage> decode(BitStreamView bs) const {
+        if(deflated()) {
             return std::make_unique<CompressedMulticutImage>(bs, partition_codec.get(), multicut_codec.get());
         }
         else {
             return std::make_unique<MulticutImage>(bs, partition_codec.get(), multicut_codec.get());
         }
     }
+
+    // decodes only the pixels in roi (see MulticutImage::decode_region). with a TiledMulticutCodec in indexed mode,
+    // only the tiles intersecting roi are decoded, as its streams are never deflated (see deflated).
+    std::unique_ptr<MulticutImage> decode_region(BitStreamView bs, const cv::Rect& roi) const {
+        if(deflated()) {
+            return std::make_unique<MulticutImage>(
+                CompressedMulticutImage::decode_region(bs, roi, partition_codec.get(), multicut_codec.get()));
+        }
+        else {
+            return std::make_unique<MulticutImage>(
+                MulticutImage::decode_region(bs, roi, partition_codec.get(), multicut_codec.get()));
+        }
+    }
+
+    // wraps an encoded image of size rows x cols in the container format (see container.h), along with the
+    // config of the codecs. throws for codecs that have no id or config (see container_config).
+    ContainerWriter make_container(const BitStream& bs, uint32_t rows, uint32_t cols) const {
+        ContainerInfo info = container_info();
+        std::string config = container_config();
+        if(config.empty()) {
+            throw std::invalid_argument("Codec: containers require codecs with an id and a config");
+        }
+        info.rows = rows;
+        info.cols = cols;
+
+        BitStream config_bs;
+        for(char c : config) {
+            config_bs.append<uint8_t>(c, 8);
+        }
+
+        ContainerWriter writer(info);
+        writer.add_chunk(container::CHUNK_CONFIG, config_bs);
+        writer.add_chunk(container::CHUNK_IMAGE, bs);
+        return writer;
+    }
+
+    // decodes the image chunk of the container in place. throws if the container was not written by
+    // a codec of the same configuration (the ids in the header and the config chunk are compared), or if a chunk is corrupt.
+    std::unique_ptr<MulticutImage> decode(const ContainerReader& reader) const {
+        ContainerInfo expected = container_info();
+        std::string expected_config = container_config();
+        if(expected_config.empty()) {
+            throw std::invalid_argument("Codec: containers require codecs with an id and a config");
+        }
+
+        const ContainerInfo& info = reader.info();
+        if(info.flags != expected.flags ||
+           info.partition_codec != expected.partition_codec ||
+           info.multicut_codec != expected.multicut_codec) {
+            throw std::runtime_error("Codec: the container was written with a different codec");
+        }
+
+        size_t c = reader.find(container::CHUNK_CONFIG);
+        if(c == ContainerReader::npos || !reader.verify(c)) {
+            throw std::runtime_error("Codec: the container has no valid codec config");
+        }
+        BitStreamReader config_reader(reader.chunk(c));
+        std::string config(config_reader.bs.size() / 8, '\0');
+        for(char& ch : config) {
+            ch = char(config_reader.read8u());
+        }
+        if(config != expected_config) {
+            throw std::runtime_error("Codec: the container was written with a different codec configuration (" + config + ")");
+        }
+
+        size_t i = reader.find(container::CHUNK_IMAGE);
+        if(i == ContainerReader::npos) {
+            throw std::runtime_error("Codec: the container has no image");
+        }
+        if(!reader.verify(i)) {
+            throw std::runtime_error("Codec: the image in the container is corrupt");
+        }
+        // the size is also stored in the Header of the image, both have to agree
+        std::unique_ptr<MulticutImage> res = decode(reader.chunk(i));
+        if(uint32_t(res->rows()) != info.rows || uint32_t(res->cols()) != info.cols) {
+            throw std::runtime_error("Codec: the size of the image does not match the container");
+        }
+        return res;
+    }
     
+private:
+
+    // the flags and codec ids stored in the header of a container
+    ContainerInfo container_info() const {
+        ContainerInfo info;
+        info.flags = deflated() ? container::FLAG_COMPRESSED : 0;
+
+        const std::type_info& p_type = typeid(*partition_codec);
+        if(p_type == typeid(MeanCodec)) info.partition_codec = container::MEAN_CODEC;
+        else if(p_type == typeid(DifferentialMeanCodec)) info.partition_codec = container::DIFFERENTIAL_MEAN_CODEC;
+
+        const std::type_info& m_type = typeid(*multicut_codec);
+        if(m_type == typeid(DefaultMulticutCodec)) info.multicut_codec = container::DEFAULT_MULTICUT_CODEC;
+        else if(m_type == typeid(DynamicHuffmanCodec)) info.multicut_codec = container::DYNAMIC_HUFFMAN_CODEC;
+        else if(m_type == typeid(BorderCodec)) info.multicut_codec = container::BORDER_CODEC;
+        else if(m_type == typeid(MulticutAwareCodec)) info.multicut_codec = container::MULTICUT_AWARE_CODEC;
+        else if(m_type == typeid(TiledMulticutCodec)) info.multicut_codec = container::TILED_MULTICUT_CODEC;
+
+        return info;
+    }
+
+    // whether the encoded images are passed through the deflate stage. streams of multicut codecs with random access
+    // are left as they are, inflating them would make decoding a region as slow as decoding the whole image.
+    // they consist of entropy coded tiles and a fixed width palette, which deflate hardly shrinks anyway.
+    bool deflated() const {
+        return compressed && !multicut_codec->random_access();
+    }
+
+    // the parameters of both codecs, which have to agree exactly for a container to be decoded.
+    // empty if a codec has no id (this also excludes subclasses of the known codecs) or does not describe itself.
+    std::string container_config() const {
+        ContainerInfo info = container_info();
+        if(info.partition_codec == container::UNKNOWN_CODEC || info.multicut_codec == container::UNKNOWN_CODEC) {
+            return "";
+        }
+        std::string p_config = partition_codec->config();
+        std::string m_config = multicut_codec->config();
+        if(p_config.empty() || m_config.empty()) return "";
+        return p_config + ";" + m_config;
+    }
+
+    // mc has to be labeled like Multicut(mask), its mask is encoded as is
+    BitStream encode_multicut(const cv::Mat& img, Multicut& mc, PartitionCodecBase* codec, bool codec_initialized) const {
+        BitStream res;
+        // the mask of the image is not needed, it is taken from mc
+        if(deflated()) {
+            CompressedMulticutImage mc_img(cv::Mat(), img);
+            mc_img.level = compression_level;
+            mc_img.encode(mc, res, codec, multicut_codec->clone().get(), codec_initialized);
+        } else {
+            MulticutImage mc_img(cv::Mat(), img);
+            mc_img.encode(mc, res, codec, multicut_codec->clone().get(), codec_initialized);
+        }
+        return res;
+    }
+
 };
 
 struct CodecBuilder {
@@ -102,7 +237,7 @@ public:
     // decoding purposes.
     template <typename Optimizer, typename... Args>
     static constexpr bool TakesCodecParam =
-        std::is_same_v<Optimizer, GreedyOptimizer> || std::is_same_v<Optimizer, GreedyGridOptimizer>;
+        std::is_constructible_v<Optimizer, Args..., std::unique_ptr<PartitionCodecBase>>;
 
     template <typename Optimizer, typename... Args>
     static constexpr bool IsValidOptimizer = std::is_constructible_v<Optimizer, Args...>;
@@ -131,8 +266,29 @@ public:
         return *this;
     }
 
-    CodecBuilder& enable_compression() {
+    // Accepts optimizers templated on the partition codec (i.e. set_optimizer<GreedyOptimizer>(...)).
+    // If the partition codec is one of the builtin ones, the matching specialization is instantiated,
+    // which calls the codec without virtual dispatch. Any other codec uses Optimizer<PartitionCodecBase>.
+    template<template<typename> class Optimizer, typename... Args>
+    CodecBuilder& set_optimizer(Args&&... args) {
+        if constexpr(!IsValidOptimizer<Optimizer<PartitionCodecBase>, Args...>) {
+            if(codec.partition_codec) {
+                const std::type_info& type = typeid(*codec.partition_codec);
+                if(type == typeid(MeanCodec)) {
+                    return set_optimizer<Optimizer<MeanCodec>>(std::forward<Args>(args)...);
+                }
+                if(type == typeid(DifferentialMeanCodec)) {
+                    return set_optimizer<Optimizer<DifferentialMeanCodec>>(std::forward<Args>(args)...);
+                }
+            }
+        }
+        return set_optimizer<Optimizer<PartitionCodecBase>>(std::forward<Args>(args)...);
+    }
+
+    // has no effect for multicut codecs with random access (see Codec::deflated)
+    CodecBuilder& enable_compression(deflate_stage::Level level = deflate_stage::AUTO) {
         codec.compressed = true;
+        codec.compression_level = level;
         return *this;
     }
 
@@ -0,0 +1,181 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <utility>
+#include <algorithm>
+
+// A d-ary max-heap, whose elements are addressed by a stable integer id (i.e. the id of an edge).
+// Unlike boost::heap::d_ary_heap, an element can be updated or removed in place through its id,
+// so no stale entries pile up and the heap always holds at most one entry per id.
+// Ids should be dense (0 ... n-1), as a position lookup table of that size is kept.
+// Compare follows the std::priority_queue convention: cmp(a, b) == true means a has lower priority.
+template<typename T, typename Compare, size_t arity = 4>
+class IndexedHeap {
+
+    static_assert(arity >= 2);
+
+    struct Entry {
+        T value;
+        int32_t id;
+    };
+
+    std::vector<Entry> heap;
+    std::vector<int32_t> position; // maps id -> index into heap, -1 if the id is not contained
+    Compare cmp;
+
+public:
+
+    IndexedHeap(size_t n_ids = 0) : position(n_ids, -1) {
+
+    }
+
+    void reserve(size_t n) {
+        heap.reserve(n);
+        if(position.size() < n) position.resize(n, -1);
+    }
+
+    bool empty() const {
+        return heap.empty();
+    }
+
+    size_t size() const {
+        return heap.size();
+    }
+
+    bool contains(int32_t id) const {
+        return id >= 0 && id < position.size() && position[id] != -1;
+    }
+
+    const T& top() const {
+        assert(!empty());
+        return heap[0].value;
+    }
+
+    int32_t top_id() const {
+        assert(!empty());
+        return heap[0].id;
+    }
+
+    const T& get(int32_t id) const {
+        assert(contains(id));
+        return heap[position[id]].value;
+    }
+
+    // insert the element with the given id, or replace its value if it is already contained
+    void push_or_update(int32_t id, const T& value) {
+        assert(id >= 0);
+        if(id >= position.size()) position.resize(id + 1, -1);
+
+        int32_t i = position[id];
+        if(i == -1) {
+            i = heap.size();
+            heap.push_back({value, id});
+            position[id] = i;
+            sift_up(i);
+            return;
+        }
+
+        bool increased = cmp(heap[i].value, value);
+        heap[i].value = value;
+        if(increased) sift_up(i);
+        else sift_down(i);
+    }
+
+    // remove the element with the given id, does nothing if it is not contained
+    void erase(int32_t id) {
+        if(!contains(id)) return;
+        remove_at(position[id]);
+    }
+
+    // calls f(id, value) for every element whose value satisfies pred. pred has to be monotone with respect
+    // to the heap order (if it holds for an element, it holds for every element of higher priority),
+    // which allows skipping the subtrees below the first element that fails it.
+    template<typename Pred, typename F>
+    void visit_top(Pred&& pred, F&& f) const {
+        if(heap.empty() || !pred(heap[0].value)) return;
+
+        std::vector<size_t> stack = {0};
+        while(!stack.empty()) {
+            size_t i = stack.back();
+            stack.pop_back();
+            f(heap[i].id, heap[i].value);
+
+            size_t first = i * arity + 1;
+            size_t last = std::min(first + arity, heap.size());
+            for(size_t c = first; c < last; c++) {
+                if(pred(heap[c].value)) stack.push_back(c);
+            }
+        }
+    }
+
+    void pop() {
+        assert(!empty());
+        remove_at(0);
+    }
+
+    void clear() {
+        for(const Entry& e : heap) position[e.id] = -1;
+        heap.clear();
+    }
+
+private:
+
+    void remove_at(size_t i) {
+        position[heap[i].id] = -1;
+
+        if(i == heap.size() - 1) {
+            heap.pop_back();
+            return;
+        }
+
+        heap[i] = std::move(heap.back());
+        heap.pop_back();
+        position[heap[i].id] = i;
+
+        // the moved element may need to go either way
+        if(i > 0 && cmp(heap[parent(i)].value, heap[i].value)) sift_up(i);
+        else sift_down(i);
+    }
+
+    static size_t parent(size_t i) {
+        return (i - 1) / arity;
+    }
+
+    void sift_up(size_t i) {
+        Entry e = std::move(heap[i]);
+        while(i > 0) {
+            size_t p = parent(i);
+            if(!cmp(heap[p].value, e.value)) break;
+            heap[i] = std::move(heap[p]);
+            position[heap[i].id] = i;
+            i = p;
+        }
+        heap[i] = std::move(e);
+        position[heap[i].id] = i;
+    }
+
+    void sift_down(size_t i) {
+        Entry e = std::move(heap[i]);
+        size_t n = heap.size();
+        while(true) {
+            size_t first = i * arity + 1;
+            if(first >= n) break;
+
+            size_t last = std::min(first + arity, n);
+            size_t best = first;
+            for(size_t c = first + 1; c < last; c++) {
+                if(cmp(heap[best].value, heap[c].value)) best = c;
+            }
+
+            if(!cmp(e.value, heap[best].value)) break;
+            heap[i] = std::move(heap[best]);
+            position[heap[i].id] = i;
+            i = best;
+        }
+        heap[i] = std::move(e);
+        position[heap[i].id] = i;
+    }
+
+};
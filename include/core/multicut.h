@@ -3,6 +3,7 @@
 #include <unordered_set>
 #include <map>
 #include <cassert>
+#include <numeric>
 
 #include <opencv2/core/mat.hpp>
 #include <opencv2/opencv.hpp>
@@ -11,6 +12,7 @@
 #include "header.h"
 #include "timing.h"
 #include "util.h"
+#include "region_graph.h"
 
 #include <boost/unordered/unordered_flat_set.hpp>
 
@@ -30,6 +32,11 @@ struct PartitionData
 {
     std::vector<cv::Point2i> points;
     int age;
+
+    // only used in pixel list mode (see Multicut::with_pixel_lists)
+    int32_t head = -1; // index of the first pixel (r * cols + c) of the partition
+    int32_t tail = -1; // index of the last pixel of the partition
+    uint32_t n_points = 0;
 };
 
 struct Multicut
@@ -37,7 +44,15 @@ struct Multicut
 
     cv::Mat mask;
     std::vector<PartitionData> partitions;
-    std::vector<key_set> neighbours;
+    RegionAdjacencyGraph graph;
+
+    // In pixel list mode, the pixels of a partition are not stored as a vector of points.
+    // Instead, all pixels form singly linked lists through next_pixel, so that a join only splices two lists.
+    // The mask is not updated during joins, label lookups go through a union-find over the partition keys 
+    // instead (see find and label_at). Call materialize_mask to bring the mask up to date.
+    bool pixel_lists = false;
+    std::vector<int32_t> next_pixel; // index of the next pixel in the same partition, -1 terminates the list
+    std::vector<partition_key> parents;
 
     Multicut() = default;
 
@@ -46,13 +61,123 @@ struct Multicut
         init_from_mask<true>();
     };
 
-    static Multicut without_relabel(const cv::Mat& mask) {
+    // the mask must contain the labels 0 ... n_partitions-1. if n_partitions is not given,
+    // the labels are expected to be in row-major order, so that the last pixel has the largest label
+    static Multicut without_relabel(const cv::Mat& mask, size_t n_partitions = 0) {
+        Multicut res;
+        res.mask = mask.clone();
+        res.init_from_mask<false>(n_partitions);
+        return res;
+    }
+
+    // creates a multicut in pixel list mode, which makes joins O(1) (apart from the neighbour updates)
+    static Multicut with_pixel_lists(const cv::Mat& mask) {
+        Multicut res;
+        res.mask = mask.clone();
+        res.pixel_lists = true;
+        res.init_from_mask<true>();
+        return res;
+    }
+
+    // same as above, but for a mask that already contains the labels 0 ... n_partitions-1
+    static Multicut with_pixel_lists(const cv::Mat& mask, size_t n_partitions) {
+        Multicut res;
+        res.mask = mask.clone();
+        res.pixel_lists = true;
+        res.init_from_mask<false>(n_partitions);
+        return res;
+    }
+
+    // creates a multicut from a mask whose labels are below n_labels, but not necessarily dense, relabeling
+    // them like Multicut(mask) with a lookup table instead of a hash map (see compact).
+    // The region adjacency graph is not built, so the result can be encoded, but not optimized.
+    static Multicut from_sparse_labels(const cv::Mat& mask, size_t n_labels) {
         Multicut res;
         res.mask = mask.clone();
-        res.init_from_mask<false>();
+        res.pixel_lists = true;
+        res.init_from_mask<false>(n_labels, false);
+        res.compact();
         return res;
     }
 
+    size_t partition_size(partition_key pk) const {
+        if(pixel_lists) return partitions[pk].n_points;
+        return partitions[pk].points.size();
+    }
+
+    // calls f(const cv::Point2i&) for every pixel of the partition
+    template<typename F>
+    void for_each_point(partition_key pk, F&& f) const {
+        if(pixel_lists) {
+            for(int32_t i = partitions[pk].head; i != -1; i = next_pixel[i]) {
+                f(cv::Point2i(i % mask.cols, i / mask.cols));
+            }
+        }
+        else {
+            for(const cv::Point2i& p : partitions[pk].points) {
+                f(p);
+            }
+        }
+    }
+
+    // returns the key of the partition the given (possibly already joined) partition key belongs to
+    partition_key find(partition_key pk) {
+        if(!pixel_lists) return pk;
+        while(parents[pk] != pk) {
+            parents[pk] = parents[parents[pk]]; // path halving
+            pk = parents[pk];
+        }
+        return pk;
+    }
+
+    partition_key label_at(int r, int c) {
+        return find(mask.at<partition_key>(r, c));
+    }
+
+    // writes the current labels to the mask. Only has an effect in pixel list mode.
+    void materialize_mask() {
+        if(!pixel_lists) return;
+        for(int r = 0; r < mask.rows; r++) {
+            partition_key* row = mask.ptr<partition_key>(r);
+            for(int c = 0; c < mask.cols; c++) {
+                row[c] = find(row[c]);
+            }
+        }
+    }
+
+    // relabels the remaining partitions 0 ... n-1 in the order of their first pixel (which are the keys 
+    // Multicut(mask) would assign) and drops the joined ones. The mask is brought up to date.
+    // The region adjacency graph is cleared, so the multicut can be encoded but not optimized any further.
+    // returns the new key of every old key, or -1 if it was joined into another partition.
+    std::vector<partition_key> compact() {
+        std::vector<partition_key> old_to_new(partitions.size(), -1);
+        partition_key n = 0;
+        for(int r = 0; r < mask.rows; r++) {
+            partition_key* row = mask.ptr<partition_key>(r);
+            for(int c = 0; c < mask.cols; c++) {
+                partition_key& key = old_to_new[find(row[c])];
+                if(key == -1) key = n++;
+                row[c] = key;
+            }
+        }
+
+        std::vector<PartitionData> compacted(n);
+        for(partition_key pk = 0; pk < partitions.size(); pk++) {
+            if(old_to_new[pk] == -1) continue;
+            compacted[old_to_new[pk]] = std::move(partitions[pk]);
+            compacted[old_to_new[pk]].age = 0;
+        }
+        partitions = std::move(compacted);
+
+        if(pixel_lists) {
+            parents.resize(n);
+            std::iota(parents.begin(), parents.end(), 0);
+        }
+        graph = RegionAdjacencyGraph();
+
+        return old_to_new;
+    }
+
     // apply a move indiciated by an edge, updating the mask and partitions.
     // returns a partition key that references the name of the new partition
     // the returned key is one of pk1 or pk2.
@@ -70,31 +195,31 @@ struct Multicut
         partitions.at(pk1).age++;
         partitions.at(pk2).age++;
 
-        auto &points1 = partitions.at(pk1).points;
-        auto &points2 = partitions.at(pk2).points;
-
-        for (const cv::Point2i &p : points1) // is this really needed?
-        {
-            mask.at<partition_key>(p) = pk2;
+        if(pixel_lists) {
+            PartitionData& data1 = partitions[pk1];
+            PartitionData& data2 = partitions[pk2];
+            next_pixel[data2.tail] = data1.head;
+            data2.tail = data1.tail;
+            data2.n_points += data1.n_points;
+            data1.head = data1.tail = -1;
+            data1.n_points = 0;
+            parents[pk1] = pk2;
         }
+        else {
+            auto &points1 = partitions.at(pk1).points;
+            auto &points2 = partitions.at(pk2).points;
 
-        points2.reserve(points1.size() + points2.size());
-        points2.insert(points2.end(), points1.begin(), points1.end());
-
-        auto &nbs1 = neighbours.at(pk1);
-        auto &nbs2 = neighbours.at(pk2);
+            for (const cv::Point2i &p : points1) // is this really needed?
+            {
+                mask.at<partition_key>(p) = pk2;
+            }
 
-        for (auto old_nb : nbs1)
-        {
-            neighbours.at(old_nb).erase(pk1);
-            neighbours.at(old_nb).insert(pk2);
+            points2.reserve(points1.size() + points2.size());
+            points2.insert(points2.end(), points1.begin(), points1.end());
+            std::vector<cv::Point2i>().swap(points1); // release the memory of the joined partition
         }
 
-        nbs2.insert(nbs1.begin(), nbs1.end());
-        nbs2.erase(pk1);
-        nbs2.erase(pk2);
-
-        nbs1 = key_set();
+        graph.merge(pk1, pk2);
 
         return pk2;
     }
@@ -104,17 +229,36 @@ struct Multicut
         return partitions.at(pk1).age == age1 && partitions.at(pk2).age == age2;
     }
 
-    const key_set& NOINLINE get_neighbours(partition_key pk) const // TODO: might wanna make this return a reference
+    // the neighbours of pk along with the ids of the connecting edges. invalidated by join.
+    std::span<const RegionAdjacencyGraph::Slot> NOINLINE get_neighbours(partition_key pk) const
     {
-        return neighbours.at(pk);
+        return graph.neighbours(pk);
     }
 
 private:
 
+    void add_point(partition_key pk, int r, int c) {
+        if(pixel_lists) {
+            PartitionData& data = partitions[pk];
+            int32_t i = r * mask.cols + c;
+            if(data.tail == -1) data.head = i;
+            else next_pixel[data.tail] = i;
+            data.tail = i;
+            data.n_points++;
+        }
+        else {
+            partitions[pk].points.emplace_back(c, r);
+        }
+    }
+
     template<bool relabel>
-    void init_from_mask()
+    void init_from_mask(size_t n_partitions = 0, bool build_graph = true)
     {
 
+        if(pixel_lists) {
+            next_pixel.assign(mask.rows * mask.cols, -1);
+        }
+
         if constexpr(relabel) {
 
             std::unordered_map<int32_t, partition_key> idx2key;
@@ -131,53 +275,41 @@ private:
                     {
                         new_key = partitions.size();
                         idx2key[idx] = new_key;
-                        std::vector<cv::Point2i> v;
-                        v.emplace_back(c, r);
-                        partitions.emplace_back(v, 0);
+                        partitions.emplace_back();
+                        partitions.back().age = 0;
                     }
                     else
                     {
                         new_key = idx2key.at(idx);
-                        partitions[new_key].points.emplace_back(c, r);
                     }
 
+                    add_point(new_key, r, c);
+
                     mask.at<int32_t>(r, c) = new_key;
                 }
             }
         }
         else {
 
-            size_t n_partitions = mask.at<partition_key>(mask.rows-1, mask.cols-1) + 1;
+            if(n_partitions == 0) n_partitions = mask.at<partition_key>(mask.rows-1, mask.cols-1) + 1;
             partitions.resize(n_partitions);
 
             for(int r = 0; r < mask.rows; r++) {
                 for(int c = 0; c < mask.cols; c++) {
                     partition_key pk = mask.at<partition_key>(r, c);
-                    partitions.at(pk).points.emplace_back(c, r);
+                    add_point(pk, r, c);
                 }
             }
 
         }
 
-        neighbours.resize(partitions.size());
-
-        static std::vector<std::pair<int, int>> delta = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
-        for (int r = 0; r < mask.rows; r++)
-        {
-            for (int c = 0; c < mask.cols; c++)
-            {
-                partition_key pk = mask.at<int32_t>(r, c);
-                for (const auto &[dr, dc] : delta)
-                {
-                    int nr = r + dr;
-                    int nc = c + dc;
-                    if (nr < 0 || nc < 0 || nr >= mask.rows || nc >= mask.cols)
-                        continue;
-                    partition_key nk = mask.at<int32_t>(nr, nc);
-                    if (pk != nk)
-                        neighbours.at(pk).insert(nk);
-                }
+        if(pixel_lists) {
+            parents.resize(partitions.size());
+            for(partition_key pk = 0; pk < partitions.size(); pk++) {
+                parents[pk] = pk;
             }
         }
+
+        if(build_graph) graph.build(mask, partitions.size());
     }
 };
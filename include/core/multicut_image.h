@@ -5,6 +5,8 @@
 #include "util.h"
 #include "diagnostics.h"
 
+#include <algorithm>
+
 struct MulticutImage
 {
 
@@ -16,7 +18,7 @@ struct MulticutImage
     MulticutImage(const MulticutImage& other) : img(img), mask(mask.clone()) {};
     
     MulticutImage(
-        const BitStream& stream,
+        BitStreamView stream,
         PartitionCodecBase* partition_codec,
         MulticutCodecBase* multicut_codec)
     {
@@ -25,24 +27,64 @@ struct MulticutImage
         Header header(reader);
         mask = multicut_codec->read_mask(reader, header.rows, header.cols);
         img = cv::Mat(header.rows, header.cols, CV_8UC3);
-        
-        Multicut mc(mask);
-        partition_codec->initialize(&mc.partitions, &img);
-        partition_codec->decode(reader, img);
+
+        // read_mask already yields the labels of the partition keys, so no relabeling is needed
+        partition_key max_label = 0;
+        for(int r = 0; r < mask.rows; r++) {
+            const partition_key* row = mask.ptr<partition_key>(r);
+            max_label = std::max(max_label, *std::max_element(row, row + mask.cols));
+        }
+        partition_codec->decode_from_mask(reader, mask, max_label + 1, img);
     }
 
     MulticutImage(MulticutImage &&mc_img) = default;
 
+    // decodes only the pixels in roi (clipped to the image), mask and img have the size of the clipped roi.
+    // the mask keeps the labels the partitions have in the whole image.
+    static MulticutImage decode_region(
+        BitStreamView stream,
+        cv::Rect roi,
+        PartitionCodecBase* partition_codec,
+        MulticutCodecBase* multicut_codec)
+    {
+        BitStreamReader reader(stream);
+        Header header(reader);
+        roi &= cv::Rect(0, 0, header.cols, header.rows);
+        if(roi.empty()) {
+            throw std::invalid_argument("MulticutImage: the region lies outside of the image");
+        }
+
+        MulticutImage res;
+        size_t n_partitions;
+        res.mask = multicut_codec->read_region(reader, header.rows, header.cols, roi, n_partitions);
+        res.img = cv::Mat(roi.height, roi.width, CV_8UC3);
+        partition_codec->decode_region(reader, res.mask, n_partitions, res.img);
+        return res;
+    }
+
     virtual ~MulticutImage() = default;
 
+    // encodes the multicut (whose mask is used instead of the own one) with the colors of img.
+    // if codec_initialized is set, partition_codec has already been set up for the multicut (see PartitionCodecBase::rebind).
     virtual void encode(
         Multicut &multicut,
         BitStream& out_stream,
         PartitionCodecBase* partition_codec,
-        MulticutCodecBase* multicut_codec)
+        MulticutCodecBase* multicut_codec,
+        bool codec_initialized = false)
     {
-        partition_codec->initialize(&multicut.partitions, &img);
-        const cv::Mat &mask = multicut.mask;
+        // the partition keys have to be in the order in which the multicut codec labels the decoded partitions
+        Multicut relabeled;
+        cv::Mat labels;
+        Multicut* mc = &multicut;
+        if(multicut_codec->relabel(multicut.mask, labels)) {
+            relabeled = Multicut::without_relabel(labels, multicut.partitions.size());
+            mc = &relabeled;
+            codec_initialized = false;
+        }
+
+        if(!codec_initialized) partition_codec->initialize(mc, &img);
+        const cv::Mat &mask = mc->mask;
         Header(mask.rows, mask.cols).encode(out_stream);
 
         multicut_codec->write_encoding(out_stream, mask);
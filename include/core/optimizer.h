@@ -2,6 +2,7 @@
 #include "timing.h"
 #include "multicut_image.h"
 #include "diagnostics.h"
+#include "indexed_heap.h"
 
 #include <queue>
 #include <deque>
@@ -10,15 +11,32 @@
 #include <unordered_set>
 #include <ctime>
 #include <random>
+#include <numeric>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <functional>
 
 #include <boost/unordered/unordered_flat_map.hpp>
-#include <boost/heap/priority_queue.hpp>
-#include <boost/heap/d_ary_heap.hpp>
-#include <boost/heap/fibonacci_heap.hpp>
-#include <boost/heap/binomial_heap.hpp>
+
+// The result of an optimizer, handed on to encoding without rebuilding the multicut from its mask.
+// The multicut is compacted (see Multicut::compact). If the optimizer provides its partition codec,
+// the codec still refers to the keys before compaction, PartitionCodecBase::rebind with old_to_new
+// moves its statistics over to the compacted multicut.
+struct OptimizedMulticut {
+    Multicut multicut;
+    std::unique_ptr<PartitionCodecBase> partition_codec; // may be null
+    std::vector<partition_key> old_to_new;
+};
 
 struct AbstractOptimizer {
     virtual Multicut optimize(const cv::Mat& img, const cv::Mat& mask) = 0;
+
+    // like optimize, but optimizers that track the statistics of their partition codec can pass it on
+    virtual OptimizedMulticut optimize_for_encoding(const cv::Mat& img, const cv::Mat& mask) {
+        return {optimize(img, mask), nullptr, {}};
+    }
+
     virtual ~AbstractOptimizer() = default;
 };
 
@@ -80,8 +98,6 @@ struct JoinMove {
     double gain_val;
     partition_key k1;
     partition_key k2;
-    int t1;
-    int t2;
 };
 
 struct JoinMoveComparator {
@@ -142,9 +158,76 @@ public:
 
 };
 
-// using priority_queue_impl = boost::heap::fibonacci_heap<JoinMove, boost::heap::compare<JoinMoveComparator>>;
-using priority_queue_impl = boost::heap::d_ary_heap<JoinMove, boost::heap::compare<JoinMoveComparator>, boost::heap::arity<4>>;
-// using priority_queue_impl = boost::heap::binomial_heap<JoinMove, boost::heap::compare<JoinMoveComparator>>;
+using priority_queue_impl = IndexedHeap<JoinMove, JoinMoveComparator, 4>;
+
+// The sequence of joins GreedyOptimizer performs if it is never stopped, together with the weight_size
+// from which on each join is applied.
+// As long as every join saves the same amount of bits (which holds for the mean codecs), the order of the joins
+// does not depend on weight_size at all: the gain of a join is weight_size * bits + weight_err * error_gain,
+// so the join with the smallest error increase always comes first. weight_size only decides when to stop,
+// which is at the first join whose threshold -weight_err * error_gain / bits is not below it.
+// Hence, the result for any weight_size is a prefix of the recorded joins.
+struct MergeDendrogram {
+
+    struct Merge {
+        partition_key from;
+        partition_key into;
+        float threshold; // the join is applied for all weight_size > threshold (running maximum over all joins so far)
+    };
+
+    float weight_err;
+    cv::Mat initial_mask; // the labels before the first join
+    size_t n_keys = 0;
+    std::vector<Merge> merges;
+
+    MergeDendrogram(float weight_err = 1.0f) : weight_err(weight_err) {
+
+    }
+
+    void record(partition_key from, partition_key into, const EncodingResult& gain) {
+        if(gain.bits_used <= 0 || (!merges.empty() && gain.bits_used != bits_per_join)) {
+            throw std::runtime_error("MergeDendrogram requires every join to save the same, positive amount of bits.");
+        }
+        bits_per_join = gain.bits_used;
+
+        float threshold = -weight_err * gain.encoding_error / gain.bits_used;
+        if(!merges.empty()) threshold = std::max(threshold, merges.back().threshold);
+        merges.push_back({from, into, threshold});
+    }
+
+    // the multicut GreedyOptimizer finds for the given weight_size
+    Multicut cut(float weight_size) const {
+        auto end = std::partition_point(merges.begin(), merges.end(), [&](const Merge& m) {
+            return m.threshold < weight_size;
+        });
+
+        std::vector<partition_key> parent(n_keys);
+        std::iota(parent.begin(), parent.end(), 0);
+        for(auto it = merges.begin(); it != end; it++) {
+            parent[it->from] = it->into;
+        }
+
+        auto find = [&](partition_key pk) {
+            while(parent[pk] != pk) {
+                parent[pk] = parent[parent[pk]];
+                pk = parent[pk];
+            }
+            return pk;
+        };
+
+        cv::Mat mask = initial_mask.clone();
+        for(int r = 0; r < mask.rows; r++) {
+            partition_key* row = mask.ptr<partition_key>(r);
+            for(int c = 0; c < mask.cols; c++) {
+                row[c] = find(row[c]);
+            }
+        }
+        return Multicut::from_sparse_labels(mask, n_keys);
+    }
+
+private:
+    int bits_per_join = 0;
+};
 
 
 // A "perfect" join is one, that does not increase the error and, at the same time, does not increase the amount of bits used
@@ -153,11 +236,12 @@ using priority_queue_impl = boost::heap::d_ary_heap<JoinMove, boost::heap::compa
 // This function greedily searches and applies all of these joins.
 // This helps processing down the line, especially if the image contains a lot of such regions.
 // This is of particularily high importance if the image contains constantly colored regions and the MeanCodec is used.
-inline void apply_perfect_lb_joins(
+template<typename Codec>
+void apply_perfect_lb_joins(
     std::vector<EncodingResult>& partition_cost,
     Multicut& mc,
     const cv::Mat& img,
-    std::unique_ptr<PartitionCodecBase>& partition_codec
+    StaticCodec<Codec> partition_codec
 ) {
 
     RandomSet rs(mc.partitions.size());
@@ -166,12 +250,12 @@ inline void apply_perfect_lb_joins(
 
         partition_key pk = rs.get();
         bool changed = false;
-        key_set neighbours = mc.get_neighbours(pk);
-        for(partition_key pk_nb : neighbours) {
-            EncodingResult res = partition_codec->test_join_encoding(pk, pk_nb);
+        for(auto [pk_nb, edge] : mc.get_neighbours(pk)) { // copied, as the join below invalidates the slots
+            EncodingResult res = partition_codec.test_join_encoding(pk, pk_nb);
             EncodingResult gain = partition_cost[pk] + partition_cost[pk_nb] - res;
 
             if(gain.bits_used >= 0 && gain.encoding_error >= 0) {
+                partition_codec.notify_join(pk, pk_nb);
                 partition_key pk_join = mc.join(pk, pk_nb);
                 partition_cost.at(pk_join) = partition_cost[pk] + partition_cost[pk_nb] - gain;
 
@@ -188,6 +272,10 @@ inline void apply_perfect_lb_joins(
 
 }
 
+// Codec selects the partition codec at compile time, so that its functions can be inlined into the join loop
+// (see StaticCodec). The codec passed to the constructor then has to be of exactly this type.
+// The default, PartitionCodecBase, accepts any codec and calls it through virtual dispatch.
+template<typename Codec = PartitionCodecBase>
 struct GreedyOptimizer : AbstractOptimizer {
 
 private:
@@ -195,6 +283,7 @@ private:
     float weight_size; 
     bool init_perfect_joins;
     std::unique_ptr<PartitionCodecBase> partition_codec;
+    StaticCodec<Codec> codec;
 
 public:
 
@@ -206,21 +295,66 @@ public:
     ) : weight_err(weight_err), 
         weight_size(weight_size), 
         init_perfect_joins(init_perfect_joins), 
-        partition_codec(std::move(partition_codec)) {
+        partition_codec(std::move(partition_codec)),
+        codec(this->partition_codec.get()) {
 
     }
 
     virtual Multicut optimize(const cv::Mat& img, const cv::Mat& mask) {
+        // the mask is only needed at the very end, so joins can skip relabeling the pixels
+        return optimize(img, Multicut::with_pixel_lists(mask));
+    }
 
-        Multicut multicut(mask);
+    // runs the greedy joining until no adjacent partitions are left, recording every join (see MergeDendrogram).
+    // weight_size has no influence on the result.
+    MergeDendrogram build_dendrogram(const cv::Mat& img, const cv::Mat& mask) {
+        MergeDendrogram dendrogram(weight_err);
+        optimize(img, Multicut::with_pixel_lists(mask), nullptr, nullptr, &dendrogram);
+        return dendrogram;
+    }
+
+    // optimizes a multicut that was already set up by the caller (preferably in pixel list mode).
+    // if seeds is given, only joins involving a seed partition are considered initially, any further
+    // joins have to follow from those. partitions marked in frozen are never joined.
+    // if dendrogram is given, all joins are applied in the order of their error and recorded.
+    // the result is compacted (see Multicut::compact).
+    Multicut optimize(
+        const cv::Mat& img, 
+        Multicut multicut, 
+        const std::vector<char>* seeds = nullptr, 
+        const std::vector<char>* frozen = nullptr,
+        MergeDendrogram* dendrogram = nullptr
+    ) {
+        return run(img, std::move(multicut), seeds, frozen, dendrogram).multicut;
+    }
+
+    virtual OptimizedMulticut optimize_for_encoding(const cv::Mat& img, const cv::Mat& mask) {
+        return optimize_for_encoding(img, Multicut::with_pixel_lists(mask));
+    }
+
+    OptimizedMulticut optimize_for_encoding(const cv::Mat& img, Multicut multicut) {
+        OptimizedMulticut res = run(img, std::move(multicut));
+        res.partition_codec = partition_codec->clone();
+        return res;
+    }
+
+private:
+
+    OptimizedMulticut run(
+        const cv::Mat& img, 
+        Multicut multicut, 
+        const std::vector<char>* seeds = nullptr, 
+        const std::vector<char>* frozen = nullptr,
+        MergeDendrogram* dendrogram = nullptr
+    ) {
 
         auto& partitions = multicut.partitions;
-        partition_codec->initialize(&partitions, &img);
+        codec.initialize(&multicut, &img);
     
-        priority_queue_impl moves;
-        moves.reserve(img.rows * img.cols * 2);
+        // every adjacency has at most one entry in the heap, which is updated or removed in place
+        // the heap is addressed by the edge ids of the region adjacency graph
+        priority_queue_impl moves(multicut.graph.n_edge_ids());
     
-        // std::unordered_map<UnorderedKey, std::pair<time, time>, UnorderedKeyHash> join_age; // if or when this join was last computed
         std::vector<EncodingResult> partition_cost;
         partition_cost.resize(partitions.size());
     
@@ -228,108 +362,321 @@ public:
     
         // compute initial costs
         for(partition_key pk = 0; pk < partitions.size(); pk++) {
-            partition_codec->notify_init(pk);
-            EncodingResult result = partition_codec->test_encoding(pk);
+            codec.notify_init(pk);
+            EncodingResult result = codec.test_encoding(pk);
             total_result += result;
             partition_cost[pk] = result;
         }
     
         if(init_perfect_joins) {
-            apply_perfect_lb_joins(partition_cost, multicut, img, partition_codec);
+            apply_perfect_lb_joins(partition_cost, multicut, img, codec);
         }
+
+        std::vector<partition_key> nb_keys;
+        std::vector<int32_t> nb_edges;
+        std::vector<EncodingResult> nb_results;
+
+        // (re)compute the join potential of all edges pk-nb_keys[i] and update their heap entries
+        auto update_moves = [&](partition_key pk) {
+            nb_results.resize(nb_keys.size());
+            codec.test_join_encoding_batch(pk, nb_keys, nb_results);
+
+            for(size_t i = 0; i < nb_keys.size(); i++) {
+                partition_key pk_nb = nb_keys[i];
+                int32_t edge = nb_edges[i];
+                EncodingResult gain = (partition_cost[pk] + partition_cost[pk_nb]) - nb_results[i];
+                float gain_val = dendrogram ? gain.cost(0, weight_err) : gain.cost(weight_size, weight_err);
+                multicut.graph.edge(edge).gain = gain_val;
+                if(gain_val > 0 || dendrogram) {
+                    moves.push_or_update(edge, {gain, gain_val, pk, pk_nb});
+                }
+                else {
+                    moves.erase(edge);
+                }
+            }
+        };
+
+        // collects the neighbours of pk for update_moves, skipping frozen partitions
+        auto gather_neighbours = [&](partition_key pk, auto&& filter) {
+            nb_keys.clear();
+            nb_edges.clear();
+            if(frozen && (*frozen)[pk]) return;
+            for(const auto& [pk_nb, edge] : multicut.get_neighbours(pk)) {
+                if((frozen && (*frozen)[pk_nb]) || !filter(pk_nb)) continue;
+                nb_keys.push_back(pk_nb);
+                nb_edges.push_back(edge);
+            }
+        };
     
         // compute initial join potential for all neighbouring partitions
         for(partition_key pk = 0; pk < partitions.size(); pk++) {
-            key_set neighbours = multicut.get_neighbours(pk);
-            for(partition_key pk_nb : neighbours) {
-                if(pk < pk_nb) { // make sure a join is only considered once
-                    
-                    EncodingResult res = partition_codec->test_join_encoding(pk, pk_nb);
-                    EncodingResult gain = (partition_cost[pk] + partition_cost[pk_nb]) - res;
-                    float gain_val = gain.cost(weight_size, weight_err);
-                    if(gain_val > 0) {
-                        moves.push({gain, gain_val, pk, pk_nb, partitions.at(pk).age, partitions.at(pk_nb).age});
-                    }
-    
-                }
-            }
+            bool is_seed = !seeds || (*seeds)[pk];
+            gather_neighbours(pk, [&](partition_key pk_nb) {
+                return pk < pk_nb && (is_seed || (*seeds)[pk_nb]); // make sure a join is only considered once
+            });
+            update_moves(pk);
         }
     
+        if(dendrogram) {
+            multicut.materialize_mask();
+            dendrogram->initial_mask = multicut.mask.clone();
+            dendrogram->n_keys = partitions.size();
+            dendrogram->merges.reserve(partitions.size());
+        }
+
         int its = 1;
-        int newmoves = 0;
     
         // run greedy joining until convergence
         while(!moves.empty()) {
     
             its++;
     
-            // regularily keeping the size of the pq small is beneficial for performance
-            if(newmoves > 25'000) {
-                newmoves = 0;
-                priority_queue_impl new_pq;
-                for(const auto& join : moves) {
-                    if(multicut.valid_join(join.k1, join.t1, join.k2, join.t2)) {
-                        new_pq.push(join);
-                    }
-                }
-                if(new_pq.empty()) break; // forgetting this check cost me 45 minutes of debugging time
-                moves = std::move(new_pq);
+            JoinMove best_move = moves.top();
+
+            // all edges of both partitions are superseded by the edges of the joint partition
+            for(const auto& [pk_nb, edge] : multicut.get_neighbours(best_move.k1)) {
+                moves.erase(edge);
             }
-    
-            const JoinMove& best_move = moves.top();
-    
-            // check if move is still valid
-            if (!multicut.valid_join(best_move.k1, best_move.t1, best_move.k2, best_move.t2)) {
-                moves.pop();
-                continue;
+            for(const auto& [pk_nb, edge] : multicut.get_neighbours(best_move.k2)) {
+                moves.erase(edge);
             }
     
-            // perform the join, mark both involved partitions as "changed" and note the cost.
-            partition_codec->notify_join(best_move.k1, best_move.k2);
+            // perform the join and note the cost.
+            codec.notify_join(best_move.k1, best_move.k2);
             partition_key pk_join = multicut.join(best_move.k1, best_move.k2);
             partition_cost.at(pk_join) = partition_cost[best_move.k1] + partition_cost[best_move.k2] - best_move.gain;
             total_result -= best_move.gain;
-    
-            // for all neighbours of the joint partition, recompute join costs
-            const auto& neighbours = multicut.get_neighbours(pk_join);
-            // std::vector<partition_key> neighbours_vec;
-            // neighbours_vec.reserve(neighbours.size());
-            // neighbours_vec.insert(neighbours_vec.end(), neighbours.begin(), neighbours.end());
-    
-            std::vector<JoinMove> newMoves;
-            newMoves.resize(neighbours.size());
-            newmoves += neighbours.size();
-    
-            int i = 0;
-            for(partition_key pk_nb : neighbours) {
-                EncodingResult old_res = partition_cost.at(pk_join) + partition_cost.at(pk_nb);
-                EncodingResult res = partition_codec->test_join_encoding(pk_join, pk_nb);
-                EncodingResult gain = old_res - res;
-                newMoves[i++] = {gain, gain.cost(weight_size, weight_err), pk_join, pk_nb, partitions.at(pk_join).age, partitions.at(pk_nb).age};
+
+            if(dendrogram) {
+                dendrogram->record(pk_join == best_move.k1 ? best_move.k2 : best_move.k1, pk_join, best_move.gain);
             }
     
-            moves.pop();
-    
-            // std::make_heap<std::vector<JoinMove>::iterator, JoinMoveComparator>(newMoves.begin(), newMoves.end());
-            for(const auto& m : newMoves) {
-                if(m.gain_val > 0)
-                    moves.push(m);
-            }
+            // for all neighbours of the joint partition, recompute join costs
+            gather_neighbours(pk_join, [](partition_key) { return true; });
+            update_moves(pk_join);
     
+        }
     
+        std::vector<partition_key> old_to_new = multicut.compact();
+        return {std::move(multicut), nullptr, std::move(old_to_new)};
+    }
+
+
+};
+
+// Runs the greedy joining in rounds, each of which applies a whole set of joins at once.
+// A join is selected if it is the best join of both of its partitions (ties broken by edge id) and its gain
+// is at least (1 - tolerance) times the best gain of the round. The selected joins are therefore pairwise
+// disjoint and can be applied concurrently. tolerance = 0 only applies joins of maximal gain, which stays
+// close to the order of GreedyOptimizer, larger values allow more joins per round (and thereby more parallelism).
+// The partition codec's test_join_encoding must be safe to call concurrently, and so must notify_join
+// for disjoint pairs of partitions.
+struct ParallelGreedyOptimizer : AbstractOptimizer {
+
+private:
+    float weight_err;
+    float weight_size; 
+    bool init_perfect_joins;
+    float tolerance;
+    std::unique_ptr<PartitionCodecBase> partition_codec;
+
+public:
+
+    ParallelGreedyOptimizer(
+        float weight_err, 
+        float weight_size, 
+        bool init_perfect_joins,
+        float tolerance,
+        std::unique_ptr<PartitionCodecBase> partition_codec
+    ) : weight_err(weight_err), 
+        weight_size(weight_size), 
+        init_perfect_joins(init_perfect_joins), 
+        tolerance(tolerance),
+        partition_codec(std::move(partition_codec)) {
+
+    }
+
+    virtual Multicut optimize(const cv::Mat& img, const cv::Mat& mask) {
+        return optimize(img, Multicut::with_pixel_lists(mask));
+    }
+
+    // the result is compacted (see Multicut::compact)
+    Multicut optimize(const cv::Mat& img, Multicut multicut) {
+        return run(img, std::move(multicut)).multicut;
+    }
+
+    virtual OptimizedMulticut optimize_for_encoding(const cv::Mat& img, const cv::Mat& mask) {
+        return optimize_for_encoding(img, Multicut::with_pixel_lists(mask));
+    }
+
+    OptimizedMulticut optimize_for_encoding(const cv::Mat& img, Multicut multicut) {
+        OptimizedMulticut res = run(img, std::move(multicut));
+        res.partition_codec = partition_codec->clone();
+        return res;
+    }
+
+private:
+
+    OptimizedMulticut run(const cv::Mat& img, Multicut multicut) {
+
+        auto& partitions = multicut.partitions;
+        RegionAdjacencyGraph& graph = multicut.graph;
+        partition_codec->initialize(&multicut, &img);
+
+        std::vector<EncodingResult> partition_cost(partitions.size());
+
+        for(partition_key pk = 0; pk < partitions.size(); pk++) {
+            partition_codec->notify_init(pk);
+            partition_cost[pk] = partition_codec->test_encoding(pk);
         }
     
-        return Multicut(multicut.mask); // TODO: This is broken!!!!!!
+        if(init_perfect_joins) {
+            apply_perfect_lb_joins(partition_cost, multicut, img, StaticCodec<PartitionCodecBase>(partition_codec.get()));
+        }
+
+        int32_t n_edges = graph.n_edge_ids();
+        std::vector<EncodingResult> edge_gain(n_edges);
+        priority_queue_impl moves(n_edges);
+
+        auto compute_gain = [&](int32_t e) {
+            auto& data = graph.edge(e);
+            EncodingResult res = partition_codec->test_join_encoding(data.u, data.v);
+            edge_gain[e] = (partition_cost[data.u] + partition_cost[data.v]) - res;
+            data.gain = edge_gain[e].cost(weight_size, weight_err);
+        };
+
+        auto update_move = [&](int32_t e) {
+            const auto& data = graph.edge(e);
+            if(data.gain > 0) {
+                moves.push_or_update(e, {edge_gain[e], data.gain, data.u, data.v});
+            }
+            else {
+                moves.erase(e);
+            }
+        };
+
+        // the edge of u that wins against all other edges of u
+        auto best_edge = [&](partition_key u) {
+            int32_t best = -1;
+            float best_gain = 0;
+            for(const auto& [nb, e] : graph.neighbours(u)) {
+                float gain = graph.edge(e).gain;
+                if(best == -1 || gain > best_gain || (gain == best_gain && e < best)) {
+                    best = e;
+                    best_gain = gain;
+                }
+            }
+            return best;
+        };
 
+        #pragma omp parallel for schedule(static)
+        for(int32_t e = 0; e < n_edges; e++) {
+            if(graph.edge(e).u != -1) compute_gain(e); // perfect joins might have removed the edge already
+        }
+
+        for(int32_t e = 0; e < n_edges; e++) {
+            if(graph.edge(e).u != -1) update_move(e);
+        }
+
+        std::vector<int32_t> candidates;
+        std::vector<char> is_selected;
+        std::vector<int32_t> selected;
+        std::vector<partition_key> joined;
+        std::vector<int32_t> changed_edges;
+        std::vector<uint32_t> last_changed(n_edges, 0);
+        uint32_t round = 0;
+
+        while(!moves.empty()) {
+
+            round++;
+
+            double threshold = moves.top().gain_val * (1.0 - tolerance);
+            candidates.clear();
+            moves.visit_top(
+                [&](const JoinMove& m) { return m.gain_val >= threshold; },
+                [&](int32_t e, const JoinMove& m) { candidates.push_back(e); }
+            );
+
+            is_selected.assign(candidates.size(), 0);
+            #pragma omp parallel for schedule(static)
+            for(int i = 0; i < candidates.size(); i++) {
+                int32_t e = candidates[i];
+                const auto& data = graph.edge(e);
+                is_selected[i] = best_edge(data.u) == e && best_edge(data.v) == e;
+            }
+
+            selected.clear();
+            for(int i = 0; i < candidates.size(); i++) {
+                if(is_selected[i]) selected.push_back(candidates[i]);
+            }
+
+            // the selected joins are disjoint, so the codec can process them concurrently
+            #pragma omp parallel for schedule(static)
+            for(int i = 0; i < selected.size(); i++) {
+                const auto& data = graph.edge(selected[i]);
+                partition_codec->notify_join(data.u, data.v);
+            }
+
+            // the graph is shared between all joins, so they are applied one after another
+            joined.clear();
+            changed_edges.clear();
+            for(int32_t e : selected) {
+                partition_key u = graph.edge(e).u;
+                partition_key v = graph.edge(e).v;
+
+                for(const auto& [pk_nb, edge] : graph.neighbours(u)) {
+                    moves.erase(edge);
+                }
+                for(const auto& [pk_nb, edge] : graph.neighbours(v)) {
+                    moves.erase(edge);
+                }
+
+                partition_key pk_join = multicut.join(u, v);
+                partition_cost[pk_join] = partition_cost[u] + partition_cost[v] - edge_gain[e];
+                joined.push_back(pk_join);
+            }
+
+            // all edges of the joint partitions need to be reevaluated
+            for(partition_key pk_join : joined) {
+                for(const auto& [pk_nb, edge] : graph.neighbours(pk_join)) {
+                    if(last_changed[edge] != round) {
+                        last_changed[edge] = round;
+                        changed_edges.push_back(edge);
+                    }
+                }
+            }
+
+            #pragma omp parallel for schedule(static)
+            for(int i = 0; i < changed_edges.size(); i++) {
+                compute_gain(changed_edges[i]);
+            }
+
+            for(int32_t e : changed_edges) {
+                update_move(e);
+            }
+        }
+
+        std::vector<partition_key> old_to_new = multicut.compact();
+        return {std::move(multicut), nullptr, std::move(old_to_new)};
     }
 
+};
 
+// how GreedyGridOptimizer joins partitions across the borders of its cells
+enum class GridFinalPass {
+    STITCH,         // only revisit the partitions along the cell seams, in parallel (see GreedyGridOptimizer::stitch)
+    FULL,           // run a GreedyOptimizer over the whole image
+    FULL_PARALLEL   // run a ParallelGreedyOptimizer over the whole image
 };
 
+// Codec is passed on to the GreedyOptimizers of the cells and seams (see GreedyOptimizer).
+template<typename Codec = PartitionCodecBase>
 struct GreedyGridOptimizer : AbstractOptimizer {
 
     float weight_size, weight_err;
     uint32_t cell_size;
+    GridFinalPass final_pass = GridFinalPass::STITCH;
+    float final_pass_tolerance = 0; // only used by GridFinalPass::FULL_PARALLEL
     
     std::unique_ptr<PartitionCodecBase> partition_codec;
 
@@ -342,23 +689,40 @@ struct GreedyGridOptimizer : AbstractOptimizer {
         weight_size(weight_size),
         cell_size(cell_size),
         partition_codec(std::move(partition_codec)) {
+        (void)StaticCodec<Codec>(this->partition_codec.get()); // fail early if the codec does not match
+    }
 
+    GreedyGridOptimizer(
+        float weight_err, 
+        float weight_size, 
+        uint32_t cell_size,
+        GridFinalPass final_pass,
+        float final_pass_tolerance,
+        std::unique_ptr<PartitionCodecBase> partition_codec
+    ) : weight_err(weight_err), 
+        weight_size(weight_size),
+        cell_size(cell_size),
+        final_pass(final_pass),
+        final_pass_tolerance(final_pass_tolerance),
+        partition_codec(std::move(partition_codec)) {
+        (void)StaticCodec<Codec>(this->partition_codec.get()); // fail early if the codec does not match
     }
 
     virtual Multicut optimize(const cv::Mat& img, const cv::Mat& mask) {
+        return optimize_for_encoding(img, mask).multicut;
+    }
+
+    // passes on the partition codec of the final pass, if it runs over the whole image
+    virtual OptimizedMulticut optimize_for_encoding(const cv::Mat& img, const cv::Mat& mask) {
 
         tic(589);
 
         MulticutImage large_img(mask, img);
-    
-        int offset = 0;
-    
-        int cells_per_row = (img.cols - 1) / cell_size + 1; // ceil
-        int cells_per_col = (img.rows - 1) / cell_size + 1;
-        int n_cells = cells_per_col * cells_per_row;
-    
+        std::vector<cv::Rect> cell_rects = make_cells(large_img);
+        std::vector<size_t> cell_partitions(cell_rects.size());
+
         #pragma omp parallel for schedule(dynamic)
-        for(int i = 0; i < n_cells; i++) {
+        for(int i = 0; i < cell_rects.size(); i++) {
 
             // #ifndef NO_DEBUG_PRINTS
             // #pragma omp critical
@@ -366,28 +730,286 @@ struct GreedyGridOptimizer : AbstractOptimizer {
                 //     std::cout << i << "/" << n_cells << std::endl;
                 // }
             // #endif
-                
-            int start_c = (i % cells_per_row) * cell_size;
-            int start_r = (i / cells_per_row) * cell_size;
-            auto roi_rect = large_img.subarea(start_r, start_c, cell_size, cell_size);
             
-            GreedyOptimizer cell_optimizer(weight_err, weight_size, true, std::move(partition_codec->clone()));
+            GreedyOptimizer<Codec> cell_optimizer(weight_err, weight_size, true, std::move(partition_codec->clone()));
             
-            MulticutImage sub_img = large_img.subimage(roi_rect);
+            MulticutImage sub_img = large_img.subimage(cell_rects[i]);
             Multicut sub_mc = cell_optimizer.optimize(sub_img.img, sub_img.mask);
     
-            cv::Mat roi = large_img.mask(roi_rect);
+            cv::Mat roi = large_img.mask(cell_rects[i]);
             sub_mc.mask.copyTo(roi);
-            roi += i * cell_size * cell_size;
+            cell_partitions[i] = sub_mc.partitions.size();
         }
-    
+
         tic(123);
-        GreedyOptimizer full_optimizer(weight_err, weight_size, false, std::move(partition_codec->clone()));
-        auto res = full_optimizer.optimize(large_img.img, large_img.mask);
+        OptimizedMulticut res = join_cells(large_img, cell_rects, cell_partitions, weight_size);
         // DIAGNOSTICS_MESSAGE("optimizer_last_call_ms", toc("last optimize_fn call took", 123));
         // DIAGNOSTICS_MESSAGE("optimizer_duration_ms", toc("optimize took", 589));
-        
-        return Multicut(res.mask);
+
+        return res;
+    }
+
+    // optimizes the image for several values of weight_size (the weight_size of this optimizer is ignored).
+    // every cell is optimized only once, recording a MergeDendrogram that is cut for every level.
+    // only joining the cells is repeated for every level.
+    // on_level is called with the index of each level and its mask, in order. only the mask of the current level
+    // is kept, so that the multicuts of all levels are never held at once.
+    void optimize_levels(
+        const cv::Mat& img, 
+        const cv::Mat& mask, 
+        const std::vector<float>& weight_sizes,
+        const std::function<void(size_t, const cv::Mat&)>& on_level
+    ) {
+
+        MulticutImage large_img(mask, img);
+        std::vector<cv::Rect> cell_rects = make_cells(large_img);
+        std::vector<MergeDendrogram> dendrograms(cell_rects.size());
+
+        // exceptions must not leave the parallel region (MergeDendrogram throws for unsupported codecs),
+        // so the first one is kept and rethrown afterwards
+        std::exception_ptr error;
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int i = 0; i < cell_rects.size(); i++) {
+            try {
+                GreedyOptimizer<Codec> cell_optimizer(weight_err, weight_size, true, std::move(partition_codec->clone()));
+                MulticutImage sub_img = large_img.subimage(cell_rects[i]);
+                dendrograms[i] = cell_optimizer.build_dendrogram(sub_img.img, sub_img.mask);
+            } catch(...) {
+                #pragma omp critical(optimize_levels_error)
+                if(!error) error = std::current_exception();
+            }
+        }
+
+        if(error) std::rethrow_exception(error);
+
+        std::vector<size_t> cell_partitions(cell_rects.size());
+
+        for(size_t l = 0; l < weight_sizes.size(); l++) {
+            float level = weight_sizes[l];
+
+            #pragma omp parallel for schedule(dynamic)
+            for(int i = 0; i < cell_rects.size(); i++) {
+                Multicut sub_mc = dendrograms[i].cut(level);
+                cv::Mat roi = large_img.mask(cell_rects[i]);
+                sub_mc.mask.copyTo(roi);
+                cell_partitions[i] = sub_mc.partitions.size();
+            }
+
+            on_level(l, join_cells(large_img, cell_rects, cell_partitions, level).multicut.mask);
+        }
+    }
+
+private:
+
+    std::vector<cv::Rect> make_cells(const MulticutImage& large_img) const {
+        int cells_per_row = (large_img.cols() - 1) / cell_size + 1; // ceil
+        int cells_per_col = (large_img.rows() - 1) / cell_size + 1;
+
+        std::vector<cv::Rect> cell_rects;
+        for(int i = 0; i < cells_per_col * cells_per_row; i++) {
+            int start_c = (i % cells_per_row) * cell_size;
+            int start_r = (i / cells_per_row) * cell_size;
+            cell_rects.push_back(large_img.subarea(start_r, start_c, cell_size, cell_size));
+        }
+        return cell_rects;
+    }
+
+    // joins the partitions of the individually optimized cells (stored in the mask of large_img, 
+    // each containing the labels 0 ... cell_partitions[i]-1) according to final_pass
+    OptimizedMulticut join_cells(
+        MulticutImage& large_img, 
+        const std::vector<cv::Rect>& cell_rects, 
+        const std::vector<size_t>& cell_partitions,
+        float weight_size
+    ) {
+        int n_cells = cell_rects.size();
+
+        // shift the labels of every cell, so that the labels of the whole image are dense
+        std::vector<size_t> label_offsets(n_cells + 1, 0);
+        for(int i = 0; i < n_cells; i++) {
+            label_offsets[i + 1] = label_offsets[i] + cell_partitions[i];
+        }
+
+        #pragma omp parallel for
+        for(int i = 0; i < n_cells; i++) {
+            cv::Mat roi = large_img.mask(cell_rects[i]);
+            roi += int(label_offsets[i]);
+        }
+    
+        if(final_pass == GridFinalPass::STITCH) {
+            int cells_per_row = (large_img.cols() - 1) / cell_size + 1;
+            int cells_per_col = (large_img.rows() - 1) / cell_size + 1;
+            stitch(large_img, cells_per_row, cells_per_col, label_offsets[n_cells], weight_size);
+            return {Multicut::from_sparse_labels(large_img.mask, label_offsets[n_cells]), nullptr, {}};
+        }
+
+        Multicut full_mc = Multicut::with_pixel_lists(large_img.mask, label_offsets[n_cells]);
+        if(final_pass == GridFinalPass::FULL_PARALLEL) {
+            ParallelGreedyOptimizer full_optimizer(weight_err, weight_size, false, final_pass_tolerance, std::move(partition_codec->clone()));
+            return full_optimizer.optimize_for_encoding(large_img.img, std::move(full_mc));
+        }
+        else {
+            GreedyOptimizer<Codec> full_optimizer(weight_err, weight_size, false, std::move(partition_codec->clone()));
+            return full_optimizer.optimize_for_encoding(large_img.img, std::move(full_mc));
+        }
+    }
+
+
+    // Joins partitions across the cell seams without a pass over the whole image.
+    // The seams are processed in blocks of 2x1 cells (horizontal seams), 1x2 cells (vertical seams) and
+    // 2x2 cells (corners), at both even and odd offsets. The blocks of one phase do not overlap and are optimized
+    // in parallel, starting only from the partitions that touch a seam inside of the block.
+    // Partitions that extend beyond their block (because they have already been joined across another seam)
+    // can not be evaluated inside of it. These, and all partitions that grew by a join, are revisited
+    // in blocks of 2x2 cells of twice the size, until no such partitions remain or a block covers the image.
+    // The mask has to contain the labels 0 ... n_labels-1, on return it contains a subset of them.
+    void stitch(MulticutImage& large_img, int cells_per_row, int cells_per_col, size_t n_labels, float weight_size) {
+
+        cv::Mat& mask = large_img.mask;
+
+        // number of pixels per label, used to detect partitions that extend beyond a block
+        std::vector<uint32_t> label_size(n_labels, 0);
+        for(int r = 0; r < mask.rows; r++) {
+            const partition_key* row = mask.ptr<partition_key>(r);
+            for(int c = 0; c < mask.cols; c++) {
+                label_size[row[c]]++;
+            }
+        }
+
+        struct Phase {
+            int rows, cols; // block size in cells
+            int offset_r, offset_c; // cell offset of the first block
+        };
+
+        static const std::vector<Phase> first_phases = {
+            {2, 1, 0, 0}, {2, 1, 1, 0},
+            {1, 2, 0, 0}, {1, 2, 0, 1},
+            {2, 2, 0, 0}, {2, 2, 1, 0}, {2, 2, 0, 1}, {2, 2, 1, 1}
+        };
+        static const std::vector<Phase> corner_phases(first_phases.begin() + 4, first_phases.end());
+
+        std::vector<char> pending(n_labels, 1); // partitions that may still be joined across a seam
+        std::vector<char> next_pending(n_labels, 0);
+        int max_cells = std::max(cells_per_row, cells_per_col);
+
+        for(int scale = 1; ; scale *= 2) {
+
+            for(const Phase& phase : scale == 1 ? first_phases : corner_phases) {
+
+                std::vector<cv::Rect> blocks; // in pixels
+                for(int br = phase.offset_r * scale; br < cells_per_col; br += phase.rows * scale) {
+                    for(int bc = phase.offset_c * scale; bc < cells_per_row; bc += phase.cols * scale) {
+                        int n_rows = std::min(phase.rows * scale, cells_per_col - br);
+                        int n_cols = std::min(phase.cols * scale, cells_per_row - bc);
+                        if(n_rows > 1 || n_cols > 1) {
+                            blocks.push_back(large_img.subarea(br * cell_size, bc * cell_size, n_rows * cell_size, n_cols * cell_size));
+                        }
+                    }
+                }
+
+                std::vector<std::vector<partition_key>> flagged(blocks.size());
+
+                #pragma omp parallel for schedule(dynamic)
+                for(int i = 0; i < blocks.size(); i++) {
+                    flagged[i] = stitch_block(large_img, blocks[i], pending, label_size, weight_size);
+                }
+
+                for(const auto& labels : flagged) {
+                    for(partition_key label : labels) next_pending[label] = 1;
+                }
+            }
+
+            if(2 * scale >= max_cells) break;
+            if(std::find(next_pending.begin(), next_pending.end(), 1) == next_pending.end()) break;
+            pending.swap(next_pending);
+            std::fill(next_pending.begin(), next_pending.end(), 0);
+        }
+    }
+
+    // optimizes a single block, starting from the pending partitions along the cell seams inside of it.
+    // returns the labels of the partitions that need to be revisited with a larger block.
+    std::vector<partition_key> stitch_block(
+        MulticutImage& large_img, 
+        const cv::Rect& rect, 
+        const std::vector<char>& pending, 
+        std::vector<uint32_t>& label_size,
+        float weight_size
+    ) {
+
+        cv::Mat block_mask = large_img.mask(rect).clone();
+
+        auto for_each_seam_pixel = [&](const cv::Mat& m, auto&& f) {
+            for(int y = cell_size; y < rect.height; y += cell_size) {
+                for(int c = 0; c < rect.width; c++) {
+                    f(m.at<partition_key>(y - 1, c), block_mask.at<partition_key>(y - 1, c));
+                    f(m.at<partition_key>(y, c), block_mask.at<partition_key>(y, c));
+                }
+            }
+            for(int x = cell_size; x < rect.width; x += cell_size) {
+                for(int r = 0; r < rect.height; r++) {
+                    f(m.at<partition_key>(r, x - 1), block_mask.at<partition_key>(r, x - 1));
+                    f(m.at<partition_key>(r, x), block_mask.at<partition_key>(r, x));
+                }
+            }
+        };
+
+        bool has_seeds = false;
+        for_each_seam_pixel(block_mask, [&](partition_key, partition_key label) {
+            has_seeds |= bool(pending[label]);
+        });
+        if(!has_seeds) return {};
+
+        Multicut mc = Multicut::with_pixel_lists(block_mask);
+        size_t n = mc.partitions.size();
+
+        std::vector<partition_key> local_to_global(n);
+        for(int r = 0; r < rect.height; r++) {
+            for(int c = 0; c < rect.width; c++) {
+                local_to_global[mc.mask.at<partition_key>(r, c)] = block_mask.at<partition_key>(r, c);
+            }
+        }
+
+        std::vector<char> frozen(n);
+        for(partition_key pk = 0; pk < n; pk++) {
+            frozen[pk] = mc.partition_size(pk) != label_size[local_to_global[pk]];
+        }
+
+        std::vector<char> seeds(n, 0);
+        for_each_seam_pixel(mc.mask, [&](partition_key pk, partition_key label) {
+            if(pending[label]) seeds[pk] = 1;
+        });
+
+        std::vector<partition_key> flagged;
+        for(partition_key pk = 0; pk < n; pk++) {
+            if(seeds[pk] && frozen[pk]) flagged.push_back(local_to_global[pk]);
+        }
+
+        GreedyOptimizer<Codec> optimizer(weight_err, weight_size, false, std::move(partition_codec->clone()));
+        Multicut res = optimizer.optimize(large_img.img(rect), std::move(mc), &seeds, &frozen);
+
+        // every resulting partition is named after the global label of one of its members.
+        // joined partitions only consist of partitions that lie entirely inside of this block,
+        // so the label can not be in use anywhere else.
+        std::vector<partition_key> new_labels(res.partitions.size());
+        for(partition_key pk = 0; pk < res.partitions.size(); pk++) {
+            int32_t first = res.partitions[pk].head;
+            partition_key label = block_mask.at<partition_key>(first / rect.width, first % rect.width);
+            new_labels[pk] = label;
+            if(res.partition_size(pk) > label_size[label]) { // the partition grew by a join
+                label_size[label] = res.partition_size(pk);
+                flagged.push_back(label);
+            }
+        }
+
+        cv::Mat roi = large_img.mask(rect);
+        for(int r = 0; r < rect.height; r++) {
+            for(int c = 0; c < rect.width; c++) {
+                roi.at<partition_key>(r, c) = new_labels[res.mask.at<partition_key>(r, c)];
+            }
+        }
+
+        return flagged;
     }
 
 };
\ No newline at end of file
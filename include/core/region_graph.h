@@ -0,0 +1,258 @@
+#pragma once
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+#include <opencv2/core/mat.hpp>
+
+// Region adjacency graph of a multicut, stored in CSR form.
+// Every node (partition) owns a contiguous range of slots in one shared array, each slot naming a neighbour
+// and the id of the connecting edge. Edge ids are assigned once when the graph is built and stay valid
+// until the edge is removed by a merge, so they can be used to address per-edge data (i.e. heap entries).
+// Merging two nodes rewrites the slot ranges in place. A range that runs out of space is moved to the end
+// of the slot array, and the array is compacted once more than half of it is unused.
+class RegionAdjacencyGraph {
+
+public:
+
+    struct Slot {
+        int32_t nb;     // the neighbouring node
+        int32_t edge;   // id of the edge to nb
+    };
+
+    struct EdgeData {
+        int32_t u, v;       // endpoints, u == -1 once the edge was removed
+        uint32_t boundary;  // number of 4-neighbour pixel pairs between u and v
+        float gain;         // cached join gain, managed by the user of the graph
+    };
+
+private:
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> start;
+    std::vector<uint32_t> degree;
+    std::vector<uint32_t> capacity;
+    std::vector<EdgeData> edges;
+
+    size_t unused_slots = 0;
+    std::vector<int32_t> marker; // scratch space for merge, maps node -> slot index in the surviving node, or -1
+
+public:
+
+    RegionAdjacencyGraph() = default;
+
+    // builds the graph of a mask containing the labels 0 ... n_nodes-1
+    RegionAdjacencyGraph(const cv::Mat& mask, size_t n_nodes) {
+        build(mask, n_nodes);
+    }
+
+    void build(const cv::Mat& mask, size_t n_nodes) {
+
+        start.assign(n_nodes + 1, 0);
+        degree.assign(n_nodes, 0);
+        marker.assign(n_nodes, -1);
+        edges.clear();
+        unused_slots = 0;
+
+        auto for_each_pair = [&](auto&& f) {
+            for(int r = 0; r < mask.rows; r++) {
+                const int32_t* row = mask.ptr<int32_t>(r);
+                const int32_t* next_row = r + 1 < mask.rows ? mask.ptr<int32_t>(r + 1) : nullptr;
+                for(int c = 0; c < mask.cols; c++) {
+                    if(c + 1 < mask.cols && row[c] != row[c + 1]) f(row[c], row[c + 1]);
+                    if(next_row && row[c] != next_row[c]) f(row[c], next_row[c]);
+                }
+            }
+        };
+
+        // count the pixel pairs per node, this is an upper bound on its degree
+        for_each_pair([&](int32_t a, int32_t b) {
+            start[a + 1]++;
+            start[b + 1]++;
+        });
+
+        for(size_t i = 0; i < n_nodes; i++) {
+            start[i + 1] += start[i];
+        }
+
+        slots.resize(start[n_nodes]);
+        for_each_pair([&](int32_t a, int32_t b) {
+            slots[start[a] + degree[a]++] = {b, -1};
+            slots[start[b] + degree[b]++] = {a, -1};
+        });
+
+        // deduplicate the ranges in place, the number of duplicates is the boundary length.
+        // the space freed by duplicates stays reserved for the node, which saves relocations later on
+        capacity.resize(n_nodes);
+        std::vector<uint32_t> boundary(slots.size());
+        for(size_t u = 0; u < n_nodes; u++) {
+            Slot* begin = slots.data() + start[u];
+            Slot* end = begin + degree[u];
+            std::sort(begin, end, [](const Slot& a, const Slot& b) { return a.nb < b.nb; });
+
+            capacity[u] = degree[u];
+            uint32_t n = 0;
+            for(Slot* s = begin; s != end; s++) {
+                if(n > 0 && begin[n - 1].nb == s->nb) {
+                    boundary[start[u] + n - 1]++;
+                    continue;
+                }
+                begin[n] = *s;
+                boundary[start[u] + n] = 1;
+                n++;
+            }
+            degree[u] = n;
+        }
+
+        // assign edge ids. nodes are visited in ascending order and their ranges are sorted, so the
+        // lower neighbours of v are seen in the same order in which they appear in the range of v.
+        std::vector<uint32_t> cursor(n_nodes, 0);
+        for(size_t u = 0; u < n_nodes; u++) {
+            for(uint32_t i = 0; i < degree[u]; i++) {
+                Slot& s = slots[start[u] + i];
+                if(s.nb < int32_t(u)) continue;
+                int32_t e = edges.size();
+                edges.push_back({int32_t(u), s.nb, boundary[start[u] + i], 0.0f});
+                s.edge = e;
+                Slot& back = slots[start[s.nb] + cursor[s.nb]++];
+                assert(back.nb == int32_t(u));
+                back.edge = e;
+            }
+        }
+
+        start.resize(n_nodes);
+    }
+
+    size_t n_nodes() const {
+        return degree.size();
+    }
+
+    // number of edge ids, including those of removed edges
+    size_t n_edge_ids() const {
+        return edges.size();
+    }
+
+    std::span<const Slot> neighbours(int32_t u) const {
+        return {slots.data() + start[u], degree[u]};
+    }
+
+    EdgeData& edge(int32_t e) {
+        return edges[e];
+    }
+
+    const EdgeData& edge(int32_t e) const {
+        return edges[e];
+    }
+
+    // returns the edge id between u and v, or -1 if they are not adjacent
+    int32_t find_edge(int32_t u, int32_t v) const {
+        if(degree[u] > degree[v]) std::swap(u, v);
+        for(const Slot& s : neighbours(u)) {
+            if(s.nb == v) return s.edge;
+        }
+        return -1;
+    }
+
+    // merges node from into node into. Edges that both nodes had to the same neighbour are combined
+    // (keeping the edge of into and adding up the boundary lengths), the edge between them is removed.
+    void merge(int32_t from, int32_t into) {
+        assert(from != into);
+
+        remove_slot(into, from);
+        for(uint32_t i = 0; i < degree[into]; i++) {
+            marker[slots[start[into] + i].nb] = i;
+        }
+
+        for(uint32_t i = 0; i < degree[from]; i++) {
+            Slot s = slots[start[from] + i];
+
+            if(s.nb == into) {
+                edges[s.edge].u = edges[s.edge].v = -1;
+                continue;
+            }
+
+            int32_t existing = marker[s.nb];
+            if(existing != -1) {
+                int32_t e = slots[start[into] + existing].edge;
+                edges[e].boundary += edges[s.edge].boundary;
+                edges[s.edge].u = edges[s.edge].v = -1;
+                remove_slot(s.nb, from);
+                continue;
+            }
+
+            // move the edge over to into
+            EdgeData& data = edges[s.edge];
+            if(data.u == from) data.u = into;
+            else data.v = into;
+            rename_slot(s.nb, from, into);
+            marker[s.nb] = degree[into];
+            append_slot(into, s);
+        }
+
+        for(uint32_t i = 0; i < degree[into]; i++) {
+            marker[slots[start[into] + i].nb] = -1;
+        }
+
+        unused_slots += capacity[from];
+        degree[from] = 0;
+        capacity[from] = 0;
+
+        if(unused_slots > slots.size() / 2) {
+            compact();
+        }
+    }
+
+private:
+
+    void remove_slot(int32_t u, int32_t nb) {
+        Slot* begin = slots.data() + start[u];
+        for(uint32_t i = 0; i < degree[u]; i++) {
+            if(begin[i].nb == nb) {
+                begin[i] = begin[degree[u] - 1];
+                degree[u]--;
+                return;
+            }
+        }
+        assert(false);
+    }
+
+    void rename_slot(int32_t u, int32_t old_nb, int32_t new_nb) {
+        for(Slot& s : std::span<Slot>(slots.data() + start[u], degree[u])) {
+            if(s.nb == old_nb) {
+                s.nb = new_nb;
+                return;
+            }
+        }
+        assert(false);
+    }
+
+    void append_slot(int32_t u, const Slot& s) {
+        if(degree[u] == capacity[u]) {
+            // move the range to the end of the slot array
+            uint32_t new_capacity = std::max<uint32_t>(4, capacity[u] * 2);
+            uint32_t new_start = slots.size();
+            slots.resize(slots.size() + new_capacity);
+            std::copy_n(slots.data() + start[u], degree[u], slots.data() + new_start);
+            unused_slots += capacity[u];
+            start[u] = new_start;
+            capacity[u] = new_capacity;
+        }
+        slots[start[u] + degree[u]++] = s;
+    }
+
+    void compact() {
+        std::vector<Slot> new_slots;
+        new_slots.reserve(slots.size() - unused_slots);
+        for(size_t u = 0; u < degree.size(); u++) {
+            uint32_t new_start = new_slots.size();
+            new_slots.insert(new_slots.end(), slots.begin() + start[u], slots.begin() + start[u] + degree[u]);
+            start[u] = new_start;
+            capacity[u] = degree[u];
+        }
+        slots = std::move(new_slots);
+        unused_slots = 0;
+    }
+
+};
@@ -1,5 +1,5 @@
 import numpy as np
-from typing import Tuple
+from typing import Tuple, List
 
 def huffman_mean_grid(img: np.ndarray, compression_strength: float = 1, cell_size: int = 128) -> Tuple[np.ndarray, int]:
     ...
@@ -8,6 +8,9 @@ def huffman_mean_grid(img: np.ndarray, compression_strength: float = 1, cell_siz
 def optimize_grid_mean(img: np.ndarray, compression_strength: float = 1, cell_size: int = 128) -> np.ndarray:
     ...
 
+def optimize_grid_mean_levels(img: np.ndarray, compression_strengths: List[float], cell_size: int = 128) -> List[np.ndarray]:
+    ...
+
 
 def test_huffman_encoding(mask: np.ndarray) -> int:
     ...
@@ -48,4 +51,5 @@ class PARTITION_CODEC(Enum):
 class OPTIMIZER(Enum):
     LOSSLESS = 0
     GREEDY = 1
-    GREEDY_GRID = 2
\ No newline at end of file
+    GREEDY_GRID = 2
+    GREEDY_GRID_PARALLEL = 3
\ No newline at end of file
@@ -61,7 +61,8 @@ namespace bindings {
     enum OPTIMIZER {
         LOSSLESS,
         GREEDY,
-        GREEDY_GRID
+        GREEDY_GRID,
+        GREEDY_GRID_PARALLEL
     };
 
 
@@ -94,6 +95,7 @@ namespace bindings {
             case LOSSLESS: cb.set_optimizer<LosslesOptimizer>(); break;
             case GREEDY: cb.set_optimizer<GreedyOptimizer>(1.0, optim_level, true); break;
             case GREEDY_GRID: cb.set_optimizer<GreedyGridOptimizer>(1.0, optim_level, 128); break;
+            case GREEDY_GRID_PARALLEL: cb.set_optimizer<GreedyGridOptimizer>(1.0, optim_level, 128, GridFinalPass::FULL_PARALLEL, 0.1f); break;
         }
 
         Codec c = cb.create();
@@ -167,12 +169,32 @@ namespace bindings {
         float compression_strength, 
         unsigned cell_size
     ) {
-        auto opt = GreedyGridOptimizer(1.0, compression_strength, cell_size, std::make_unique<MeanCodec>());
+        auto opt = GreedyGridOptimizer<MeanCodec>(1.0, compression_strength, cell_size, std::make_unique<MeanCodec>());
         auto _img = ndarray_to_mat(img);
         auto mc = opt.optimize(_img, MulticutImage::get_default_mask(_img, 1));
         return mat_to_ndarray(mc.mask);
     }
 
+    // same as optimize_grid_mean for a list of compression strengths, computed from a single optimization run
+    bp::list optimize_grid_mean_levels(
+        const np::ndarray& img, 
+        const bp::list& compression_strengths, 
+        unsigned cell_size
+    ) {
+        std::vector<float> levels;
+        for(int i = 0; i < bp::len(compression_strengths); i++) {
+            levels.push_back(bp::extract<float>(compression_strengths[i]));
+        }
+
+        auto opt = GreedyGridOptimizer<MeanCodec>(1.0, 0, cell_size, std::make_unique<MeanCodec>());
+        auto _img = ndarray_to_mat(img);
+        bp::list res;
+        opt.optimize_levels(_img, MulticutImage::get_default_mask(_img, 1), levels, [&](size_t l, const cv::Mat& mask) {
+            res.append(mat_to_ndarray(mask));
+        });
+        return res;
+    }
+
     size_t test_huffman_encoding(const np::ndarray& mask) {
         BitStream bs;
         auto enc = DynamicHuffmanCodec();
@@ -270,7 +292,8 @@ namespace bindings {
         bp::enum_<OPTIMIZER>("OPTIMIZER")
             .value("LOSSLESS", LOSSLESS)
             .value("GREEDY", GREEDY)
-            .value("GREEDY_GRID", GREEDY_GRID);
+            .value("GREEDY_GRID", GREEDY_GRID)
+            .value("GREEDY_GRID_PARALLEL", GREEDY_GRID_PARALLEL);
 
 
         bp::def("make_mask_with_size", make_mask, 
@@ -312,6 +335,14 @@ namespace bindings {
             )
         );
 
+        bp::def("optimize_grid_mean_levels", optimize_grid_mean_levels, 
+            (
+            bp::arg("img"),
+            bp::arg("compression_strengths"),
+            bp::arg("cell_size")=128
+            )
+        );
+
         /*-----------------------------------------------------------------------------------*/
 
         bp::def("test_huffman_encoding", test_huffman_encoding, (bp::arg("mask"))); 
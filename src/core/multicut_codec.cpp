@@ -1,100 +1,198 @@
 #include "multicut_codec.h"
 
-cv::Mat mask_from_edges(std::vector<bool>& row_edges, std::vector<bool>& col_edges, size_t rows, size_t cols) {
+#include <bit>
+#include <numeric>
 
-    const int32_t MAX = std::numeric_limits<int32_t>::max();
+namespace {
 
-    cv::Mat mask = cv::Mat::ones(rows, cols, CV_32SC1) * MAX;
+    // the number of rows of the blocks that are labeled in parallel
+    const int LABEL_BLOCK_ROWS = 64;
 
-    auto row_edge_exists = [&](size_t row, size_t col) -> bool {
-        if(row < 0 || row >= rows) return false;
-        if(col < 0 || col >= cols - 1) return false;
-        return row_edges[row * (cols-1) + col];
-    };
-
-    auto col_edge_exists = [&](size_t row, size_t col) -> bool {
-        if(row < 0 || row >= rows - 1) return false;
-        if(col < 0 || col >= cols) return false;
-        return col_edges[col * (rows-1) + row];
-    };
+    // the root of every set is its smallest element
+    int32_t find(std::vector<int32_t>& parent, int32_t x) {
+        while(parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
 
-    int32_t index = -1; // the segment that is currently being added
+    // same as above, without path compression, so that it can run concurrently
+    int32_t find_root(const std::vector<int32_t>& parent, int32_t x) {
+        while(parent[x] != x) {
+            x = parent[x];
+        }
+        return x;
+    }
 
-    for(size_t r = 0; r < rows; r++) {
-        for(size_t c = 0; c < cols; c++) {
+    void unite(std::vector<int32_t>& parent, int32_t a, int32_t b) {
+        a = find(parent, a);
+        b = find(parent, b);
+        if(a < b) parent[b] = a;
+        else if(b < a) parent[a] = b;
+    }
 
-            if(mask.at<int32_t>(r, c) != MAX) continue;
-            
-            std::vector<int32_t> row_stack;
-            row_stack.push_back(r);
+    // the first position >= c of a cleared bit in a packed row, which has to exist
+    int next_zero(const uint64_t* row, int c) {
+        size_t w = c >> 6;
+        uint64_t word = ~row[w] & (~uint64_t(0) >> (c & 63));
+        while(word == 0) {
+            word = ~row[++w];
+        }
+        return int(w * 64 + std::countl_zero(word));
+    }
 
-            std::vector<int32_t> col_stack;
-            col_stack.push_back(c);
+    // calls f(c) for every set bit c in [begin, end) of a packed row
+    template<typename F>
+    void for_each_set_bit(const uint64_t* row, int begin, int end, F&& f) {
+        if(begin >= end) return;
+        for(int w = begin >> 6; w <= (end - 1) >> 6; w++) {
+            uint64_t word = row[w];
+            if(w == begin >> 6) word &= ~uint64_t(0) >> (begin & 63);
+            if(w == (end - 1) >> 6 && (end & 63) != 0) word &= ~uint64_t(0) << (64 - (end & 63));
+            while(word != 0) {
+                int i = std::countl_zero(word);
+                f(w * 64 + i);
+                word &= ~(uint64_t(1) << (63 - i));
+            }
+        }
+    }
 
-            index++;
-            mask.at<int32_t>(r, c) = index;
+}
 
-            while(!row_stack.empty()) {
+// Connected component labeling on the runs of joined pixels in each row. The rows are split into blocks, which
+// are labeled in parallel: the runs of a block get the index of their first pixel as a provisional label and are
+// joined with the runs above them in a union-find, which keeps the smallest index as the root of a set. The blocks
+// are then joined along their borders. As the root of a partition is its first pixel in row-major order,
+// numbering the roots in this order yields the canonical labels.
+cv::Mat mask_from_edges(const EdgeMap& edges, size_t* n_partitions) {
+
+    const int rows = edges.rows;
+    const int cols = edges.cols;
+    cv::Mat mask(rows, cols, CV_32SC1);
+    if(n_partitions) *n_partitions = 0;
+    if(rows == 0 || cols == 0) return mask;
+
+    const int n_blocks = (rows + LABEL_BLOCK_ROWS - 1) / LABEL_BLOCK_ROWS;
+    std::vector<int32_t> parent(size_t(rows) * cols);
+    std::vector<std::vector<int32_t>> block_runs(n_blocks); // the first pixel of every run, in row-major order
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int b = 0; b < n_blocks; b++) {
+        int r_begin = b * LABEL_BLOCK_ROWS;
+        int r_end = std::min(rows, r_begin + LABEL_BLOCK_ROWS);
+        for(int r = r_begin; r < r_end; r++) {
+            int32_t* row = mask.ptr<int32_t>(r);
+            const int32_t* above = r > r_begin ? mask.ptr<int32_t>(r - 1) : nullptr;
+            const uint64_t* h = edges.horizontal_row(r);
+            for(int c = 0; c < cols;) {
+                // the run ends at the first cut, at the latest at the last column, whose bit is always cleared
+                int end = next_zero(h, c) + 1;
+                int32_t id = r * cols + c;
+                parent[id] = id;
+                block_runs[b].push_back(id);
+                std::fill(row + c, row + end, id);
+                if(above) {
+                    int32_t last = -1;
+                    for_each_set_bit(edges.vertical_row(r - 1), c, end, [&](int x) {
+                        if(above[x] != last) {
+                            last = above[x];
+                            unite(parent, id, last);
+                        }
+                    });
+                }
+                c = end;
+            }
+        }
+    }
 
-                size_t cr = row_stack.back();
-                row_stack.pop_back();
+    for(int b = 1; b < n_blocks; b++) {
+        int r = b * LABEL_BLOCK_ROWS;
+        const int32_t* above = mask.ptr<int32_t>(r - 1);
+        const int32_t* row = mask.ptr<int32_t>(r);
+        for_each_set_bit(edges.vertical_row(r - 1), 0, cols, [&](int x) {
+            unite(parent, above[x], row[x]);
+        });
+    }
 
-                size_t cc = col_stack.back();
-                col_stack.pop_back();
+    // resolve the root of every run and count the roots per block
+    std::vector<std::vector<int32_t>> run_roots(n_blocks);
+    std::vector<int32_t> first_label(n_blocks + 1, 0);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int b = 0; b < n_blocks; b++) {
+        const std::vector<int32_t>& runs = block_runs[b];
+        run_roots[b].resize(runs.size());
+        int32_t n_roots = 0;
+        for(size_t k = 0; k < runs.size(); k++) {
+            run_roots[b][k] = find_root(parent, runs[k]);
+            n_roots += run_roots[b][k] == runs[k];
+        }
+        first_label[b + 1] = n_roots;
+    }
+    std::partial_sum(first_label.begin(), first_label.end(), first_label.begin());
+    if(n_partitions) *n_partitions = first_label.back();
+
+    // the roots are no longer needed as parents, they store the labels from here on
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int b = 0; b < n_blocks; b++) {
+        int32_t label = first_label[b];
+        for(size_t k = 0; k < block_runs[b].size(); k++) {
+            if(run_roots[b][k] == block_runs[b][k]) parent[block_runs[b][k]] = label++;
+        }
+    }
 
-                if(row_edge_exists(cr, cc) && (mask.at<int32_t>(cr, cc+1) == MAX)) {
-                    row_stack.push_back(cr);
-                    col_stack.push_back(cc+1);
-                    mask.at<int32_t>(cr, cc+1) = index;
-                }
-                if(row_edge_exists(cr, cc-1) && (mask.at<int32_t>(cr, cc-1) == MAX)) {
-                    row_stack.push_back(cr);
-                    col_stack.push_back(cc-1);
-                    mask.at<int32_t>(cr, cc-1) = index;
-                }
-                if(col_edge_exists(cr, cc) && (mask.at<int32_t>(cr+1, cc) == MAX)) {
-                    row_stack.push_back(cr+1);
-                    col_stack.push_back(cc);
-                    mask.at<int32_t>(cr+1, cc) = index;
-                }
-                if(col_edge_exists(cr-1, cc) && (mask.at<int32_t>(cr-1, cc) == MAX)) {
-                    row_stack.push_back(cr-1);
-                    col_stack.push_back(cc);
-                    mask.at<int32_t>(cr-1, cc) = index;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int b = 0; b < n_blocks; b++) {
+        int r_end = std::min(rows, (b + 1) * LABEL_BLOCK_ROWS);
+        size_t k = 0;
+        for(int r = b * LABEL_BLOCK_ROWS; r < r_end; r++) {
+            int32_t* row = mask.ptr<int32_t>(r);
+            for(int c = 0; c < cols;) {
+                int32_t id = row[c];
+                int32_t label = parent[run_roots[b][k++]];
+                for(; c < cols && row[c] == id; c++) {
+                    row[c] = label;
                 }
             }
         }
     }
+
     return mask;
 
 }
 
 
-void DefaultMulticutCodec::write_encoding(BitStream& bs, const cv::Mat& mask) {
-    // append row edges
-    for(size_t r = 0; r < mask.rows; r++) {
-        for(size_t c = 0; c < mask.cols - 1; c++) {
-            bs.append(mask.at<int32_t>(r, c) == mask.at<int32_t>(r, c+1), 1);
-        }
+void DefaultMulticutCodec::write_edges(BitStream& bs, const EdgeMap& edges) {
+    BitWriter writer(bs);
+
+    // append row edges, the rows of the edge map are packed like the stream
+    for(int r = 0; r < edges.rows; r++) {
+        writer.write_bits(edges.horizontal_row(r), edges.cols - 1);
     }
 
     // append col edges
-    for(size_t c = 0; c < mask.cols; c++) {
-        for(size_t r = 0; r < mask.rows - 1; r++) {
-            bs.append(mask.at<int32_t>(r, c) == mask.at<int32_t>(r+1, c), 1);
+    for(int c = 0; c < edges.cols; c++) {
+        for(int r = 0; r < edges.rows - 1; r++) {
+            writer.write_bit(edges.vertical(r, c));
         }
     }
 }
 
 
 cv::Mat DefaultMulticutCodec::read_mask(BitStreamReader& reader, size_t rows, size_t cols) {
-    size_t n_row_edges = (cols - 1) * rows;
-    size_t n_col_edges = cols * (rows - 1);
-
-    auto row_edges = reader.read_bits(n_row_edges);
-    auto col_edges = reader.read_bits(n_col_edges);
-
-    return mask_from_edges(row_edges, col_edges, rows, cols);
+    EdgeMap edges(rows, cols);
+    {
+        BitReader bits(reader);
+        for(size_t r = 0; r < rows; r++) {
+            bits.read_bits(edges.horizontal_row(r), cols - 1);
+        }
+        for(size_t c = 0; c < cols; c++) {
+            for(size_t r = 0; r + 1 < rows; r++) {
+                edges.set_vertical(r, c, bits.read_bit());
+            }
+        }
+    }
+    return mask_from_edges(edges);
 }
 
 std::unique_ptr<MulticutCodecBase> DefaultMulticutCodec::clone() const {
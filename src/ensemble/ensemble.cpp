@@ -100,6 +100,9 @@ namespace ensemble {
             else if(const auto* c = dynamic_cast<const AdapativeBitwiseCodecFactory*>(mc_codec->row_codec_factory.get())) {
                 res += std::format("adaptive({}|{})", c->order, c->window_size);
             }
+            else if(const auto* c = dynamic_cast<const DecayingBitwiseCodecFactory*>(mc_codec->row_codec_factory.get())) {
+                res += std::format("decaying({}|{})", c->order, c->shift);
+            }
             res += ";col=";
             if(dynamic_cast<const NaiveCodecFactory*>(mc_codec->col_codec_factory.get())) {
                 res += "naive";
@@ -110,6 +113,9 @@ namespace ensemble {
             else if(const auto* c = dynamic_cast<const AdapativeBitwiseCodecFactory*>(mc_codec->col_codec_factory.get())) {
                 res += std::format("adaptive({}|{})", c->order, c->window_size);
             }
+            else if(const auto* c = dynamic_cast<const DecayingBitwiseCodecFactory*>(mc_codec->col_codec_factory.get())) {
+                res += std::format("decaying({}|{})", c->order, c->shift);
+            }
             res += "]";
         }
         else if(dynamic_cast<const BorderCodec*>(codec.get())) {
@@ -139,21 +145,39 @@ namespace ensemble {
         uint32_t cell_size,
         bool differential_codec
     ) {
+        preprocess_data(data_dir, out_dir, prefix, std::vector<double>{optimization_level}, cell_size, differential_codec);
+    }
+
+    void preprocess_data(
+        const std::string& data_dir,
+        const std::string& out_dir,
+        const std::string& prefix,
+        const std::vector<double>& optimization_levels,
+        uint32_t cell_size,
+        bool differential_codec
+    ) {
     
         auto img_paths = util::find_imgs(data_dir);
     
         std::srand(42);
         int id = std::rand();
-        std::ofstream outfile(out_dir + std::format("/{}-data-{}-{}.csv", prefix, int(optimization_level), id));
-    
-    
-        outfile << "avg_partition_size,pixels,optimization_level,img_id,img_path";
-        for(int j = 0; j < Configs::configs.size(); j++) {
-            outfile << "," << make_key(Configs::configs[j]);
+
+        // one output file per optimization level
+        std::vector<std::ofstream> outfiles;
+        for(double optimization_level : optimization_levels) {
+            std::ofstream& outfile = outfiles.emplace_back(out_dir + std::format("/{}-data-{}-{}.csv", prefix, int(optimization_level), id));
+        
+            outfile << "avg_partition_size,pixels,optimization_level,img_id,img_path";
+            for(int j = 0; j < Configs::configs.size(); j++) {
+                outfile << "," << make_key(Configs::configs[j]);
+            }
+            outfile << std::endl;
         }
-        outfile << std::endl;
+
+        std::vector<float> weight_sizes(optimization_levels.begin(), optimization_levels.end());
     
-        GreedyGridOptimizer opt(1.0, optimization_level, cell_size, std::make_unique<MeanCodec>());
+        // all levels are cut from the same run (see MergeDendrogram)
+        GreedyGridOptimizer<MeanCodec> opt(1.0, 0, cell_size, std::make_unique<MeanCodec>());
     
         int proc = 0;
     
@@ -164,35 +188,39 @@ namespace ensemble {
             #pragma omp critical(stdio)
             {
                 proc++;
-                std::cout << std::format("opt {} starting to process {} ({}/{})", optimization_level, img_paths[i], proc, img_paths.size()) << std::endl;
+                std::cout << std::format("starting to process {} ({}/{})", img_paths[i], proc, img_paths.size()) << std::endl;
             }
 
-            Multicut mc = opt.optimize(img, MulticutImage::get_default_mask(img, 1));
-    
-            auto features = make_features(mc.mask, optimization_level);
-    
-            std::vector<uint32_t> bits;
-            for(int j = 0; j < Configs::configs.size(); j++) {
-                BitStream tmp;
-                Configs::configs[j]->write_encoding(tmp, mc.mask);
-                bits.push_back(tmp.size());
-            }
-    
-            #pragma omp critical(fileio)
-            {
-                outfile << std::format(
-                    "{},{},{},{},{}", 
-                    features["avg_partition_size"], features["pixels"], features["optimization_level"], i, img_paths[i]
-                );
-                for(const auto& v : bits) {
-                    outfile << "," << v;
+            opt.optimize_levels(img, MulticutImage::get_default_mask(img, 1), weight_sizes, [&](size_t l, const cv::Mat& mask) {
+                auto features = make_features(mask, optimization_levels[l]);
+                EdgeMap edges(mask); // shared by all configs
+        
+                std::vector<uint32_t> bits;
+                for(int j = 0; j < Configs::configs.size(); j++) {
+                    BitStream tmp;
+                    Configs::configs[j]->write_edges(tmp, edges);
+                    bits.push_back(tmp.size());
                 }
-                outfile << std::endl;
-            }
+        
+                #pragma omp critical(fileio)
+                {
+                    std::ofstream& outfile = outfiles[l];
+                    outfile << std::format(
+                        "{},{},{},{},{}", 
+                        features["avg_partition_size"], features["pixels"], features["optimization_level"], i, img_paths[i]
+                    );
+                    for(const auto& v : bits) {
+                        outfile << "," << v;
+                    }
+                    outfile << std::endl;
+                }
+            });
     
         }
     
-        outfile.close();
+        for(auto& outfile : outfiles) {
+            outfile.close();
+        }
     
     }
     
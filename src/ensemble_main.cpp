@@ -14,14 +14,12 @@ int main() {
     );
 
 
-    preprocess_data("../data/splitimages/test", "../ensemble_data/test", "test-v1", 1, 128, true);
+    std::vector<double> levels = {1};
     for(float lvl = 5; lvl <= 100; lvl += 5) {
-        preprocess_data("../data/splitimages/test", "../ensemble_data/test", "test-v1", lvl, 128, true);
+        levels.push_back(lvl);
     }
 
-    preprocess_data("../data/splitimages/train", "../ensemble_data/train", "train-v1", 1, 128, true);
-    for(float lvl = 5; lvl <= 100; lvl += 5) {
-        preprocess_data("../data/splitimages/train", "../ensemble_data/train", "train-v1", lvl, 128, true);
-    }
+    preprocess_data("../data/splitimages/test", "../ensemble_data/test", "test-v1", levels, 128, true);
+    preprocess_data("../data/splitimages/train", "../ensemble_data/train", "train-v1", levels, 128, true);
 
 }
\ No newline at end of file